@@ -12,7 +12,43 @@ static inline void nrf24_csn(uint8_t level) {
 		CSN_PORT &= ~CSN_PIN;
 }
 
-#if 1
+#ifdef TIMER
+/*
+ * Free-running Timer 1 timebase, counting at F_CPU / 8.  There are no
+ * interrupts in the bootloader so timer_read() extends the counter to 32
+ * bits by checking TOV1 itself, it needs to be called at least once per
+ * overflow period (~32ms at 16MHz).  If it isn't, time only runs slow and
+ * the waits get longer, never shorter.
+ */
+#define TIMER_TICKS(msec) ((uint32_t) (F_CPU / 8000.0 * (msec)))
+
+static uint16_t timer_hi;
+
+static void timer_init(void) {
+	TCCR1B = _BV(CS11); /* div 8 */
+}
+
+static uint32_t timer_read(void) {
+	uint16_t lo = TCNT1;
+
+	if (TIFR1 & _BV(TOV1)) {
+		TIFR1 = _BV(TOV1);
+		timer_hi++;
+		/* The overflow may have happened right after we read TCNT1 */
+		lo = TCNT1;
+	}
+
+	return ((uint32_t) timer_hi << 16) | lo;
+}
+
+/* Wait until at least ticks have passed since start */
+static void timer_wait(uint32_t start, uint32_t ticks) {
+	while (timer_read() - start < ticks)
+		watchdogReset();
+}
+
+#define my_delay(msec) timer_wait(timer_read(), TIMER_TICKS(msec))
+#else
 static void delay8(uint16_t count) {
 	while (count --)
 		__asm__ __volatile__ (
@@ -26,55 +62,8 @@ static void delay8(uint16_t count) {
 			"\twdr\n"
 		);
 }
-#ifndef TIMER
-#define my_delay(msec) delay8((int) (F_CPU / 8000L * (msec)))
-#endif
-
-#else
-volatile unsigned long timer0_overflow_count = 0;
-#define clockCyclesPerMicrosecond() ( F_CPU / 1000000L )
-
-static unsigned long micros() {
-	unsigned long m;
-	uint8_t oldSREG = SREG, t;
-
-	__asm__ __volatile__ ("cli");
-	m = timer0_overflow_count;
-#if defined(TCNT0)
-	t = TCNT0;
-#elif defined(TCNT0L)
-	t = TCNT0L;
-#else
-	#error TIMER 0 not defined
-#endif
-
-#ifdef TIFR0
-	if ((TIFR0 & _BV(TOV0)) && (t < 255))
-		m++;
-#else
-	if ((TIFR & _BV(TOV0)) && (t < 255))
-		m++;
-#endif
-
-	SREG = oldSREG;
-
-	return ((m << 8) + t) * (64 / clockCyclesPerMicrosecond());
-}
-
-static void delay(unsigned long ms)
-{
-	uint32_t start = micros();
 
-	while (ms > 0) {
-		while ( ms > 0 && (micros() - start) >= 1000) {
-			ms--;
-			start += 1000;
-		}
-	}
-}
-
-#undef my_delay
-#define my_delay delay
+#define my_delay(msec) delay8((int) (F_CPU / 8000L * (msec)))
 #endif
 
 static inline void nrf24_ce(uint8_t level) {
@@ -96,10 +85,11 @@ static inline void nrf24_ce(uint8_t level) {
 #ifdef TIMER
 	static uint32_t prev_ce_edge;
 
+	/* Only wait for whatever is left of the period after the last edge */
 	if (level)
-		while (timer_read() - prev_ce_edge <= F_CPU / 100000);
+		timer_wait(prev_ce_edge, TIMER_TICKS(0.01));
 	else
-		while (timer_read() - prev_ce_edge <= F_CPU / 5000);
+		timer_wait(prev_ce_edge, TIMER_TICKS(0.2));
 #else
 	/* This should take at least 10us (rising) or 200us (falling) */
 	if (level)
@@ -181,14 +171,29 @@ static void nrf24_delay(void) {
 	my_delay(5);
 }
 
+#ifdef RADIO_IRQ
+/* Enable 16-bit CRC, all three interrupts are reflected on the IRQ pin */
+#define CONFIG_VAL ((1 << CRCO) | (1 << EN_CRC))
+
+/* The IRQ line is active low */
+static inline uint8_t nrf24_irq(void) {
+	return !(IRQ_INPUT & IRQ_PIN);
+}
+#else
 /* Enable 16-bit CRC */
 #define CONFIG_VAL ((1 << MASK_RX_DR) | (1 << MASK_TX_DS) | \
 		(1 << MASK_MAX_RT) | (1 << CRCO) | (1 << EN_CRC))
+#endif
+
+#define RF_SETUP_VAL ((1 << RF_PWR_LOW) | (1 << RF_PWR_HIGH))
 
 static int nrf24_init(void) {
 	/* CE and CSN are outputs */
 	CE_DDR |= CE_PIN;
 	CSN_DDR |= CSN_PIN;
+#ifdef RADIO_IRQ
+	IRQ_DDR &= ~IRQ_PIN;
+#endif
 
 	nrf24_ce(0);
 	nrf24_csn(1);
@@ -199,16 +204,25 @@ static int nrf24_init(void) {
 	if (nrf24_read_reg(SETUP_RETR) != 0x7f)
 		return 1; /* There may be no nRF24 connected */
 
-	/* Maximum Tx power, 250kbps data rate */
-	nrf24_write_reg(RF_SETUP, (1 << RF_PWR_LOW) | (1 << RF_PWR_HIGH) |
-			(1 << RF_DR_HIGH));
+	/* Maximum Tx power, 2Mbps data rate */
+	nrf24_write_reg(RF_SETUP, RF_SETUP_VAL | (1 << RF_DR_HIGH));
 	/* Dynamic payload length for TX & RX (pipes 0 and 1) */
 	nrf24_write_reg(DYNPD, 0x03);
+#ifdef RADIO_ACK_PAYLOAD
+	/* Also allow payloads in the ACK packets */
+	nrf24_write_reg(FEATURE, (1 << EN_DPL) | (1 << EN_ACK_PAY));
+#else
 	nrf24_write_reg(FEATURE, 1 << EN_DPL);
+#endif
+	/*
+	 * The chip isn't reset together with us so there may be payloads
+	 * left over from a previous session in the Tx FIFO.
+	 */
+	nrf24_tx_flush();
 	/* Reset status bits */
 	nrf24_write_reg(STATUS, (1 << RX_DR) | (1 << TX_DS) | (1 << MAX_RT));
-	/* Set some RF channel number */
-	nrf24_write_reg(RF_CH, 98);
+	/* Set the RF channel the gateway first contacts us on */
+	nrf24_write_reg(RF_CH, RADIO_CHANNEL);
 	/* 3-byte addresses */
 	//nrf24_write_reg(SETUP_AW, 0x01);
 	/* Enable ACKing on both pipe 0 & 1 for TX & RX ACK support */
@@ -264,11 +278,147 @@ static void nrf24_idle_mode(uint8_t standby) {
 	nrf24_in_rx = 0;
 }
 
+#ifdef RADIO_RATE_FALLBACK
+static uint8_t nrf24_rate = 1 << RF_DR_HIGH;
+
+/*
+ * Change the air data rate in Rx mode, 0 for 2Mbps, 1 for 1Mbps and 2 for
+ * 250kbps.  CE is pulsed low around the change.
+ */
+static void nrf24_set_rate(uint8_t rate) {
+	nrf24_rate = !rate ? (1 << RF_DR_HIGH) :
+		rate == 1 ? 0 : (1 << RF_DR_LOW);
+
+	nrf24_ce(0);
+	nrf24_write_reg(RF_SETUP, RF_SETUP_VAL | nrf24_rate);
+	nrf24_ce(1);
+}
+#endif
+
+#ifdef RADIO_SURVEY
+/* Change channels in Rx mode, CE is pulsed low around the change */
+static void nrf24_set_channel(uint8_t ch) {
+	nrf24_ce(0);
+	nrf24_write_reg(RF_CH, ch);
+	nrf24_ce(1);
+}
+
+/*
+ * Sample the Received Power Detector RADIO_SURVEY_SAMPLES times on each
+ * channel of the survey set and return the channel with the fewest
+ * samples above -64dBm.  RPD is only valid 170us into Rx mode (130us
+ * settling plus 40us for the AGC) and is cleared when Rx is disabled, so
+ * every sample is a fresh CE high period.  Leaves the chip in Standby-I
+ * back on RADIO_CHANNEL.
+ */
+static uint8_t nrf24_survey(void) {
+	uint8_t ch = RADIO_SURVEY_FIRST, best = ch, least = 0xff;
+	uint8_t n = RADIO_SURVEY_COUNT, i, hits;
+
+	nrf24_write_reg(CONFIG, CONFIG_VAL | (1 << PWR_UP) | (1 << PRIM_RX));
+	/* Power Down to Standby-I */
+	my_delay(1.5);
+
+	do {
+		nrf24_write_reg(RF_CH, ch);
+
+		hits = 0;
+		for (i = RADIO_SURVEY_SAMPLES; i; i--) {
+			nrf24_ce(1);
+			my_delay(0.17);
+			hits += nrf24_read_reg(RPD) & 1;
+			nrf24_ce(0);
+		}
+
+		if (hits < least) {
+			least = hits;
+			best = ch;
+		}
+
+		ch += RADIO_SURVEY_STEP;
+	} while (--n);
+
+	nrf24_write_reg(RF_CH, RADIO_CHANNEL);
+
+	return best;
+}
+#endif
+
+#ifdef RADIO_ADAPTIVE_ARD
+#ifdef RADIO_RATE_FALLBACK
+/* At 250kbps the ACK takes longer than the minimum 250us to come back */
+#define NRF24_ARD_MIN (nrf24_rate == (1 << RF_DR_LOW))
+#else
+#define NRF24_ARD_MIN 0
+#endif
+
+/*
+ * Auto Retransmit Delay, in 250us steps above 250us.  It's raised by one
+ * step for every packet that needed RADIO_ARD_UP or more retransmits (or
+ * hit MAX_RT) and lowered by one after RADIO_ARD_DOWN packets in a row
+ * went through on the first try, so it settles at the shortest delay that
+ * still lets the ACKs come back in time.  It's only written to the chip
+ * while CE is low, in nrf24_tx_start() and nrf24_tx_retry().
+ *
+ * ARC stays at 15, the most the chip can do.  On bad links the software
+ * retries after MAX_RT in radio_tx_wait() are what extend it further, so
+ * there's nothing to gain from a lower count.
+ */
+static uint8_t nrf24_ard = 0;
+
+static void nrf24_ard_update(uint8_t status, uint8_t arc) {
+	static uint8_t clean = 0;
+
+	if ((status & (1 << MAX_RT)) || arc >= RADIO_ARD_UP) {
+		clean = 0;
+		if (nrf24_ard < 15)
+			nrf24_ard++;
+	} else if (!arc && ++clean == RADIO_ARD_DOWN) {
+		clean = 0;
+		if (nrf24_ard)
+			nrf24_ard--;
+	}
+
+	if (nrf24_ard < NRF24_ARD_MIN)
+		nrf24_ard = NRF24_ARD_MIN;
+}
+
+#define nrf24_set_retr() \
+	nrf24_write_reg(SETUP_RETR, (nrf24_ard << ARD) | (15 << ARC))
+#endif
+
+#if defined(RADIO_STATS) || defined(RADIO_ADAPTIVE_ARD)
+/*
+ * Retransmits the last packet needed, 15 after MAX_RT.  Read it straight
+ * after the TX_DS or MAX_RT event: the next payload in the FIFO resets
+ * ARC_CNT, but it only starts counting one ARD later.
+ */
+static uint8_t nrf24_arc_cnt(void) {
+	return (nrf24_read_reg(OBSERVE_TX) >> ARC_CNT) & 0x0f;
+}
+#endif
+
 static uint8_t nrf24_rx_new_data(void) {
 	return (nrf24_read_status() >> RX_DR) & 1;
 }
 
+#ifdef RADIO_IRQ
+/* Set after reading a payload, there may be more queued behind it */
+static uint8_t nrf24_rx_more = 1;
+#endif
+
 static uint8_t nrf24_rx_fifo_data(void) {
+#ifdef RADIO_IRQ
+	/*
+	 * Only go to the chip when the IRQ line says there's something new.
+	 * RX_DR is cleared as we read each payload though, so the line says
+	 * nothing about packets that were already waiting in the FIFO -- check
+	 * the FIFO once after each read to catch those.
+	 */
+	if (!nrf24_rx_more && !nrf24_irq())
+		return 0;
+	nrf24_rx_more = 0;
+#endif
 	return !(nrf24_read_reg(FIFO_STATUS) & (1 << RX_EMPTY));
 }
 
@@ -285,28 +435,87 @@ static uint8_t nrf24_rx_data_avail(void) {
 	return ret;
 }
 
-static void nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
+#ifdef TIMER
+/* When the last payload was read, the sender was in Tx mode until then */
+static uint32_t nrf24_rx_time;
+#endif
+
+/*
+ * Start reading the next payload out of the Rx FIFO.  Returns its length
+ * and leaves the chip selected, the caller clocks the payload in with
+ * spi_transfer(0) and then releases the chip with nrf24_csn(1).
+ */
+static uint8_t nrf24_rx_begin(void) {
 	uint8_t len;
 
+#ifdef RADIO_ACK_PAYLOAD
+	/* TX_DS is set whenever one of our ACK payloads goes out */
+	nrf24_write_reg(STATUS, (1 << RX_DR) | (1 << TX_DS));
+#else
 	nrf24_write_reg(STATUS, 1 << RX_DR);
+#endif
+#ifdef RADIO_IRQ
+	nrf24_rx_more = 1;
+#endif
+#ifdef TIMER
+	nrf24_rx_time = timer_read();
+#endif
 
 	len = nrf24_rx_data_avail();
-	*pkt_len = len;
 
 	nrf24_csn(0);
 
 	spi_transfer(R_RX_PAYLOAD);
+
+	return len;
+}
+
+static void nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
+	uint8_t len = nrf24_rx_begin();
+
+	*pkt_len = len;
 	while (len --)
 		*buf ++ = spi_transfer(0);
 
 	nrf24_csn(1);
 }
 
-static void nrf24_tx(uint8_t *buf, uint8_t len) {
+static void nrf24_write_payload(uint8_t cmd, uint8_t *buf, uint8_t len) {
+	nrf24_csn(0);
+
+	spi_transfer(cmd);
+	while (len --)
+		spi_transfer(*buf ++);
+
+	nrf24_csn(1);
+}
+
+#ifdef RADIO_ACK_PAYLOAD
+/*
+ * Queue a payload to be sent back in the auto-ACK of the next packet
+ * received on the given pipe.  The chip stays in Rx mode, the other side
+ * collects the payload by sending us anything, even an empty packet.
+ * Up to three payloads fit in the Tx FIFO, returns non-zero if it's full.
+ */
+static uint8_t nrf24_ack_payload(uint8_t pipe, uint8_t *buf, uint8_t len) {
+	if (nrf24_read_status() & (1 << TX_FULL))
+		return 1;
+
+	nrf24_write_payload(W_ACK_PAYLOAD | pipe, buf, len);
+	return 0;
+}
+#endif
+
+/*
+ * Switch to Tx mode and leave CE high.  The chip then sends whatever gets
+ * queued with nrf24_tx_push(), up to three payloads can be waiting in the
+ * FIFO, until nrf24_tx_end() is called.
+ */
+static void nrf24_tx_start(void) {
 	/*
 	 * The user may have put the chip out of Rx mode to perform a
 	 * few Tx operations in a row, or they may have left the chip
-	 * in Rx which we'll switch back on when this Tx is done.
+	 * in Rx which we'll switch back on when the Tx is done.
 	 */
 	if (nrf24_in_rx) {
 		nrf24_idle_mode(1);
@@ -314,63 +523,108 @@ static void nrf24_tx(uint8_t *buf, uint8_t len) {
 		nrf24_in_rx = 1;
 	}
 
+#ifdef RADIO_IRQ
+	/*
+	 * A payload that arrived before we left Rx mode would hold the IRQ
+	 * line low through the whole transmission.  Clear RX_DR so that the
+	 * line only means TX_DS or MAX_RT, and have nrf24_rx_fifo_data()
+	 * check the FIFO itself once we're back in Rx.
+	 */
+	nrf24_write_reg(STATUS, 1 << RX_DR);
+	nrf24_rx_more = 1;
+#endif
+#ifdef RADIO_ADAPTIVE_ARD
+	nrf24_set_retr();
+#endif
 	/* Tx mode */
 	nrf24_write_reg(CONFIG, CONFIG_VAL | (1 << PWR_UP));
 	/* Use pipe 0 for receiving ACK packets */
 	nrf24_write_reg(EN_RXADDR, 0x01);
 
-	/*
-	 * The TX_FULL bit is automatically reset on a successful Tx, but
-	 * the FIFO is apparently not actually cleaned so bad things happen
-	 * if we don't flush it manually even though the datasheet says
-	 * a W_TX_PAYLOAD resets the FIFO contents same as a FLUSH_TX.
-	 * This may be connected with the fact of using automatic ACKing.
-	 * But if don't we flush the FIFO here it looks like each payload
-	 * gets retransmitted about 3 times (sometimes 2, sometimes 4)
-	 * instead of the chip picking up what we've written.  After that
-	 * it picks up whatever the new payload is and again stops accepting
-	 * new payloads for another while.
-	 */
-	nrf24_tx_flush();
-
-	nrf24_csn(0);
+	nrf24_ce(1);
+}
 
-	spi_transfer(W_TX_PAYLOAD);
-	while (len --)
-		spi_transfer(*buf ++);
+static void nrf24_tx_push(uint8_t *buf, uint8_t len) {
+	nrf24_write_payload(W_TX_PAYLOAD, buf, len);
+}
 
-	nrf24_csn(1);
+static uint8_t nrf24_tx_full(void) {
+	return nrf24_read_status() & (1 << TX_FULL);
+}
 
-	/*
-	 * Set CE high for at least 10us - that's 160 cycles at 16MHz.
-	 * But we can also leave it that way until tx_result_wait().
-	 */
-	nrf24_ce(1);
+static uint8_t nrf24_tx_empty(void) {
+	return nrf24_read_reg(FIFO_STATUS) & (1 << TX_EMPTY);
 }
 
-static int nrf24_tx_result_wait(void) {
+/*
+ * Wait for the next TX_DS or MAX_RT event, for up to ~100ms, and clear
+ * it.  Returns the STATUS value, without either bit set on a timeout.
+ * Note that a single TX_DS may stand for more than one payload sent.
+ */
+static uint8_t nrf24_tx_event(void) {
 	uint8_t status;
-	uint16_t count = 10000; /* ~100ms timeout */
-
-	status = nrf24_read_status();
+#ifdef TIMER
+	uint32_t start = timer_read();
+#else
+	uint16_t count = 10000;
+#endif
 
-	while ((!(status & (1 << TX_DS)) || (status & (1 << TX_FULL))) &&
-			!(status & (1 << MAX_RT)) && --count) {
-		//delay8((int) (F_CPU / 8000L * 0.01));
-		my_delay(10);
+	while (1) {
+#ifdef RADIO_IRQ
+		/*
+		 * TX_DS and MAX_RT pull the IRQ line low so there's no need
+		 * to poll STATUS until then.  RX_DR was cleared on the way
+		 * into Tx mode, see nrf24_tx_start().
+		 */
+		status = nrf24_irq() ? nrf24_read_status() : 0;
+#else
 		status = nrf24_read_status();
-	}
+#endif
+		if (status & ((1 << TX_DS) | (1 << MAX_RT)))
+			break;
 
-	nrf24_ce(0);
+#ifdef TIMER
+		watchdogReset();
+		if (timer_read() - start >= TIMER_TICKS(100))
+			break;
+#else
+		if (!--count)
+			break;
+		my_delay(0.01);
+#endif
+	}
 
 	/* Reset status bits */
 	nrf24_write_reg(STATUS, (1 << MAX_RT) | (1 << TX_DS));
 
+	return status;
+}
+
+/*
+ * Retry the payload at the head of the FIFO after a MAX_RT.
+ *
+ * A payload that hits MAX_RT is not removed from the Tx FIFO, it stays
+ * at the head and goes out again on the next CE rising edge.  We used to
+ * write the same payload again for every retry, so each failure left one
+ * more copy in the FIFO: these later got sent 2-4 times in a row, and once
+ * the FIFO was full any new W_TX_PAYLOAD was silently dropped.  That's
+ * what the FLUSH_TX before every packet was papering over.  Simply
+ * pulsing CE retransmits the failed payload without duplicating it.
+ */
+static void nrf24_tx_retry(void) {
+	nrf24_ce(0);
+#ifdef RADIO_ADAPTIVE_ARD
+	nrf24_set_retr();
+#endif
+	nrf24_ce(1);
+}
+
+static void nrf24_tx_end(void) {
+	nrf24_ce(0);
+
 	if (nrf24_in_rx) {
 		nrf24_in_rx = 0;
 
 		nrf24_rx_mode();
 	}
-
-	return (status & (1 << TX_DS)) ? 0 : -1;
 }
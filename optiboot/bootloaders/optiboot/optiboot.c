@@ -132,6 +132,120 @@
 /* mode for simplicity. Slave address will be read from   */
 /* the EEPROM, needs to be set up first.                  */
 /*                                                        */
+/* RADIO_ACK_PAYLOAD:                                     */
+/* Send the replies back inside the ACKs to the gateway's */
+/* packets instead of switching to Tx for every reply.    */
+/* The radio stays in Rx for the whole session and the    */
+/* gateway has to poll for replies with empty packets.    */
+/*                                                        */
+/* RADIO_RATE_FALLBACK:                                   */
+/* Start the session at 2Mbps and let the gateway move it */
+/* to 1Mbps or 250kbps by setting parameter 0xc1, after   */
+/* the STK_OK has gone out.  Not for RADIO_ACK_PAYLOAD.   */
+/*                                                        */
+/* RADIO_IRQ:                                             */
+/* The nRF24L01+ IRQ pin is connected (see pin_defs.h),   */
+/* use it to detect Rx and Tx completion instead of       */
+/* polling the chip's registers over SPI.                 */
+/*                                                        */
+/* RADIO_ARQ:                                             */
+/* Let the gateway send up to RADIO_ARQ_WINDOW packets    */
+/* without waiting for replies and only resend the ones   */
+/* we report missing, instead of stop-and-wait per        */
+/* packet.  Sequence numbers start from 0.                */
+/*                                                        */
+/* RADIO_PAGE_STREAM:                                     */
+/* Clock flash page data from the radio straight into the */
+/* SPM page buffer instead of staging it in RAM first.    */
+/*                                                        */
+/* RADIO_ADAPTIVE_ARD:                                    */
+/* Adapt the Auto Retransmit Delay to the retransmit      */
+/* counts seen in OBSERVE_TX, starting from 250us instead */
+/* of a fixed 2ms.                                        */
+/*                                                        */
+/* PROG_MULTI:                                            */
+/* Add STK_PROG_MULTI, which writes many flash pages with */
+/* one reply per window of pages.                         */
+/*                                                        */
+/* PROG_LZ:                                               */
+/* Add STK_PROG_LZ, which writes flash pages from an LZ   */
+/* compressed stream.                                     */
+/*                                                        */
+/* PAGE_CRC:                                              */
+/* Add STK_PAGE_CRC, which returns a CRC-16 for every     */
+/* flash page in a range.                                 */
+/*                                                        */
+/* FLASH_HASH:                                            */
+/* Add STK_FLASH_HASH, which returns the CRC-32 of a      */
+/* flash range to verify an image without readback.       */
+/*                                                        */
+/* SKIP_UNCHANGED:                                        */
+/* Compare flash pages with the old contents as they come */
+/* in and don't erase or write the ones that match.       */
+/*                                                        */
+/* BIG_WRITE:                                             */
+/* Take the STK_PROG_PAGE length as 16 bits and stage up  */
+/* to BIG_WRITE_SIZE bytes (4k) in RAM, programming them  */
+/* as consecutive pages.  For the 1284P and 1280.         */
+/*                                                        */
+/* BULK_READ:                                             */
+/* Take the STK_READ_PAGE length as 16 bits and send the  */
+/* data in full payloads, a 0x10 in it doesn't end one.   */
+/*                                                        */
+/* RADIO_PROBE:                                           */
+/* Send a beacon at start-up and listen RADIO_PROBE_MS    */
+/* (20ms) for the gateway, start the application at once  */
+/* when there's none.                                     */
+/*                                                        */
+/* RESYNC:                                                */
+/* Answer a command without CRC_EOP with STK_NOSYNC and   */
+/* wait for the next one, rather than reset.              */
+/*                                                        */
+/* MANIFEST:                                              */
+/* Add STK_MANIFEST, to store and read back the length,   */
+/* CRC-32 and build id of the uploaded image.             */
+/*                                                        */
+/* MANIFEST_BOOT:                                         */
+/* Also don't start the application while the flash no    */
+/* longer matches the manifest.  Implies MANIFEST.        */
+/*                                                        */
+/* SPM_SERVICE:                                           */
+/* Let the application erase and write its own flash      */
+/* through do_spm() at the bootloader start + 2, and copy */
+/* an image it has staged into place on the next reset.   */
+/*                                                        */
+/* RESUME:                                                */
+/* Record upload progress at the end of the EEPROM and    */
+/* add STK_RESUME to continue from there after a reset.   */
+/*                                                        */
+/* EEPROM_FAST:                                           */
+/* Skip EEPROM bytes that don't change, erase or write    */
+/* only where that's enough and write in the background.  */
+/*                                                        */
+/* FLASH_PIPELINE:                                        */
+/* Don't wait for RWW flash page writes, reply at once    */
+/* and let the write finish while the next page arrives.  */
+/*                                                        */
+/* RADIO_STATS:                                           */
+/* Count packets, retransmits and flash pages and let the */
+/* gateway read the counters as parameters 0xd0-0xdd.     */
+/*                                                        */
+/* RADIO_CHANNEL:                                         */
+/* RF channel the gateway first contacts us on, 98 by     */
+/* default.                                               */
+/*                                                        */
+/* RADIO_SURVEY:                                          */
+/* Sample the carrier detect (RPD) on RADIO_SURVEY_COUNT  */
+/* channels from RADIO_SURVEY_FIRST, RADIO_SURVEY_STEP    */
+/* apart, at start-up.  The gateway can read the quietest */
+/* one as parameter 0xc0 and move the session there by    */
+/* setting that parameter.                                */
+/*                                                        */
+/* TIMER:                                                 */
+/* Run Timer 1 as a timebase for the radio so that waits  */
+/* only last as long as still needed instead of a fixed   */
+/* busy loop.  The LED flashes are timed off it too.      */
+/*                                                        */
 /**********************************************************/
 
 /**********************************************************/
@@ -217,6 +331,9 @@ asm("  .section .version\n"
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
 #include "boot.h"
+#ifdef PAGE_CRC
+#include <util/crc16.h>
+#endif
 #include "pin_defs.h"
 #include "stk500.h"
 
@@ -224,6 +341,146 @@ asm("  .section .version\n"
 #define LED_START_FLASHES 0
 #endif
 
+#if defined(RADIO_RATE_FALLBACK) && defined(RADIO_ACK_PAYLOAD)
+#error RADIO_RATE_FALLBACK does nothing with RADIO_ACK_PAYLOAD, we never transmit
+#endif
+
+#ifdef RADIO_ARQ
+#ifndef RADIO_ARQ_WINDOW
+#define RADIO_ARQ_WINDOW 8
+#endif
+#if RADIO_ARQ_WINDOW > 8 || (RADIO_ARQ_WINDOW & (RADIO_ARQ_WINDOW - 1))
+#error RADIO_ARQ_WINDOW must be a power of 2, 8 at most
+#endif
+/* Sequence numbers are 7-bit, control packets have bit 7 set */
+#define ARQ_SEQ_MASK 0x7f
+#define ARQ_ACK_REQ  0x80	/* Gateway asks which packets we have */
+#define ARQ_REPORT   0x81	/* Our answer: ARQ_REPORT, next, bitmap */
+#endif
+
+#ifdef RADIO_ADAPTIVE_ARD
+#ifdef RADIO_ACK_PAYLOAD
+#error RADIO_ADAPTIVE_ARD does nothing with RADIO_ACK_PAYLOAD, we never transmit
+#endif
+#ifndef RADIO_ARD_UP
+#define RADIO_ARD_UP 2
+#endif
+#ifndef RADIO_ARD_DOWN
+#define RADIO_ARD_DOWN 16
+#endif
+#endif
+
+#if defined(BIG_WRITE) && !defined(BIG_WRITE_SIZE)
+#define BIG_WRITE_SIZE 4096
+#endif
+
+/* Channel the gateway first contacts us on */
+#ifndef RADIO_CHANNEL
+#define RADIO_CHANNEL 98
+#endif
+
+#ifdef RESUME
+/*
+ * Upload progress, kept at the end of the EEPROM so that an upload cut
+ * short by a dropped link can be continued after the reset: the 4-byte
+ * image id the host gave in STK_RESUME, then one byte per 8 flash pages,
+ * 0x00 once all 8 of them have been written, counting only pages written
+ * in order from the start of the flash.
+ */
+#define RESUME_BYTES ((FLASHEND >> 3) / SPM_PAGESIZE + 1)
+#ifndef RESUME_EEPROM
+#define RESUME_EEPROM (E2END + 1 - 4 - RESUME_BYTES)
+#endif
+#endif
+
+#if defined(MANIFEST_BOOT) && !defined(MANIFEST)
+#define MANIFEST
+#endif
+
+#ifdef MANIFEST
+/*
+ * What the host last said it uploaded, in the EEPROM below the RESUME
+ * record if there's one: length (4 bytes, big endian), CRC-32 (4 bytes,
+ * big endian) and build id (4 bytes), then a byte that's 0x00 while the
+ * flash still holds that image.
+ */
+#ifndef MANIFEST_EEPROM
+#ifdef RESUME
+#define MANIFEST_EEPROM (RESUME_EEPROM - 13)
+#else
+#define MANIFEST_EEPROM (E2END + 1 - 13)
+#endif
+#endif
+#define manifest_ok() (!eeprom_read(MANIFEST_EEPROM + 12))
+#endif
+
+#ifdef SPM_SERVICE
+/*
+ * Set by the application once it has staged a new image in flash: the
+ * number of pages (2 bytes, big endian, 0xff first byte for none), the
+ * page it starts at (2 bytes, big endian), then the image's length,
+ * CRC-32 and build id as in the MANIFEST record, below the other EEPROM
+ * records.
+ */
+#ifndef STAGE_EEPROM
+#if defined(MANIFEST)
+#define STAGE_EEPROM (MANIFEST_EEPROM - 16)
+#elif defined(RESUME)
+#define STAGE_EEPROM (RESUME_EEPROM - 16)
+#else
+#define STAGE_EEPROM (E2END + 1 - 16)
+#endif
+#endif
+#define stage_pending() (eeprom_read(STAGE_EEPROM) != 0xff)
+#endif
+
+/* Whether the application can be started right after a reset */
+#if defined(MANIFEST_BOOT) && defined(SPM_SERVICE)
+#define app_ready() (manifest_ok() && !stage_pending())
+#elif defined(MANIFEST_BOOT)
+#define app_ready() manifest_ok()
+#elif defined(SPM_SERVICE)
+#define app_ready() (!stage_pending())
+#else
+#define app_ready() 1
+#endif
+
+#ifdef RESYNC
+#ifndef RESYNC_QUIET_MS
+#define RESYNC_QUIET_MS 5
+#endif
+#if RESYNC_QUIET_MS < 1 || RESYNC_QUIET_MS > 254
+#error RESYNC_QUIET_MS must be between 1 and 254
+#endif
+#endif
+
+#ifdef RADIO_PROBE
+#ifndef RADIO_PROBE_MS
+#define RADIO_PROBE_MS 20
+#endif
+#if RADIO_PROBE_MS < 1 || RADIO_PROBE_MS > 65535
+#error RADIO_PROBE_MS must be between 1 and 65535
+#endif
+#endif
+
+#ifdef RADIO_SURVEY
+#ifndef RADIO_SURVEY_FIRST
+#define RADIO_SURVEY_FIRST 2
+#endif
+#ifndef RADIO_SURVEY_STEP
+#define RADIO_SURVEY_STEP 24
+#endif
+#ifndef RADIO_SURVEY_COUNT
+#define RADIO_SURVEY_COUNT 6
+#endif
+#ifndef RADIO_SURVEY_SAMPLES
+#define RADIO_SURVEY_SAMPLES 16
+#endif
+#if RADIO_SURVEY_FIRST + (RADIO_SURVEY_COUNT - 1) * RADIO_SURVEY_STEP > 125
+#error The RADIO_SURVEY channels must be 125 at most
+#endif
+#endif
+
 #ifdef LUDICROUS_SPEED
 #define BAUD_RATE 230400L
 #endif
@@ -288,8 +545,22 @@ asm("  .section .version\n"
 int main(void) __attribute__ ((OS_main)) __attribute__ ((section (".init9"))) __attribute__ ((__noreturn__));
 void putch(char);
 uint8_t getch(void);
+#ifdef RADIO_ACK_PAYLOAD
+uint8_t drop_polls(void);
+#else
+void radio_tx_wait(uint8_t drain);
+#endif
+#ifdef RADIO_PAGE_STREAM
+static void getpage(uint16_t address, uint8_t length);
+#endif
 static inline void getNch(uint8_t); /* "static inline" is a compiler hint to reduce code size */
-void verifySpace();
+uint8_t verifySpace();
+#ifdef RESYNC
+/* Drop the command and go on to the next one if its CRC_EOP is missing */
+#define verify_or_resync() if (verifySpace()) continue
+#else
+#define verify_or_resync() verifySpace()
+#endif
 #if LED_START_FLASHES > 0
 static inline void flash_led(uint8_t);
 #endif
@@ -299,10 +570,50 @@ void watchdogConfig(uint8_t x);
 void wait_timeout(void) __attribute__ ((__noreturn__));
 void appStart(uint8_t rstFlags) __attribute__ ((naked))  __attribute__ ((__noreturn__));
 static int radio_init(void);
+#ifdef RADIO_PROBE
+static uint8_t radio_probe(void);
+#endif
 
 static uint8_t radio_mode = 0;
 static uint8_t radio_present = 0;
 static uint8_t pkt_max_len = 32;
+#ifndef RADIO_ACK_PAYLOAD
+/* Transmission attempts left before giving up on the current reply */
+static uint8_t tx_tries;
+#endif
+#ifdef RADIO_SURVEY
+/* Quietest channel found by the survey at start-up */
+static uint8_t radio_quiet;
+#endif
+#ifdef BULK_READ
+/*
+ * Set while putch() is sending bulk data or binary values, a 0x10 in them
+ * then isn't taken for the STK_OK that ends the reply and doesn't send a
+ * short packet.
+ */
+static uint8_t tx_raw;
+#define raw_reply(on) (tx_raw = (on))
+#else
+#define raw_reply(on)
+#endif
+
+#ifdef RADIO_STATS
+/*
+ * Session counters, the gateway reads them a byte at a time, little
+ * endian, as parameters Parm_RADIO_STATS onwards.
+ */
+#define STAT_RX		0	/* Packets received, polls included */
+#define STAT_DUP	1	/* Duplicates dropped */
+#define STAT_TX		2	/* Payloads sent plus retries after MAX_RT */
+#define STAT_MAX_RT	3	/* MAX_RT failures */
+#define STAT_ARC	4	/* Sum of ARC_CNT, retransmits by the chip */
+#define STAT_ERASE	5	/* Flash pages erased */
+#define STAT_WRITE	6	/* Flash pages written */
+static uint16_t radio_stats[7];
+#define stat_add(n, v) (radio_stats[n] += (v))
+#else
+#define stat_add(n, v)
+#endif
 
 #define CE_DDR		DDRB
 #define CE_PORT		PORTB
@@ -319,12 +630,12 @@ static uint8_t pkt_max_len = 32;
  * Addresses below NRWW (Non-Read-While-Write) can be programmed while
  * continuing to run code from flash, slightly speeding up programming
  * time.  Beware that Atmel data sheets specify this as a WORD address,
- * while optiboot will be comparing against a 16-bit byte address.  This
- * means that on a part with 128kB of memory, the upper part of the lower
- * 64k will get NRWW processing as well, even though it doesn't need it.
- * That's OK.  In fact, you can disable the overlapping processing for
- * a part entirely by setting NRWWSTART to zero.  This reduces code
- * space a bit, at the expense of being slightly slower, overall.
+ * while optiboot will be comparing against a 16-bit byte address.  On a
+ * part with 128kB of memory, NRWW_RAMPZ gives the upper 8 bits of the
+ * byte address as well, so that only the top of the upper 64k gets NRWW
+ * processing.  You can disable the overlapping processing for a part
+ * entirely by setting NRWWSTART to zero.  This reduces code space a bit,
+ * at the expense of being slightly slower, overall.
  *
  * RAMSTART should be self-explanatory.  It's bigger on parts with a
  * lot of peripheral registers.
@@ -344,18 +655,28 @@ static uint8_t pkt_max_len = 32;
 #elif defined (__AVR_ATmega1284P__)
 #define RAMSTART (0x100)
 #define NRWWSTART (0xE000)
+#define NRWW_RAMPZ (1)
 #elif defined(__AVR_ATtiny84__)
 #define RAMSTART (0x100)
 #define NRWWSTART (0x0000)
 #elif defined(__AVR_ATmega1280__)
 #define RAMSTART (0x200)
 #define NRWWSTART (0xE000)
+#define NRWW_RAMPZ (1)
 #elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega88__)
 #define RAMSTART (0x100)
 #define NRWWSTART (0x1800)
 #endif
 
+/* Whether the page at address, in the 64k bank selected by RAMPZ, is RWW */
+#if defined(RAMPZ) && defined(NRWW_RAMPZ)
+#define flash_rww(address) (RAMPZ < NRWW_RAMPZ || (address) < NRWWSTART)
+#else
+#define flash_rww(address) ((address) < NRWWSTART)
+#endif
+
 // TODO: get actual .bss+.data size from GCC
+// The Makefile fails the link if .data and .bss don't fit in BSS_SIZE
 #define BSS_SIZE	0x80
 
 /* C zero initialises all global variables. However, that requires */
@@ -363,6 +684,21 @@ static uint8_t pkt_max_len = 32;
 /* This allows us to drop the zero init code, saving us memory */
 #define buff    ((uint8_t*)(RAMSTART+BSS_SIZE))
 
+#ifdef BIG_WRITE
+/* buff holds a whole STK_PROG_PAGE of up to BIG_WRITE_SIZE bytes */
+#define BUFF_SIZE BIG_WRITE_SIZE
+#if RAMSTART + BSS_SIZE + BIG_WRITE_SIZE + 33 * 8 + 0x100 > RAMEND
+#error BIG_WRITE_SIZE does not fit in RAM, BIG_WRITE is meant for the 1284P and 1280
+#endif
+#else
+#define BUFF_SIZE SPM_PAGESIZE
+#endif
+
+#ifdef RADIO_ARQ
+/* Early packets wait in the window after the page buffer, 1 + 32 bytes each */
+#define arq_buf ((uint8_t*)(RAMSTART+BSS_SIZE+BUFF_SIZE))
+#endif
+
 /*
  * Handle devices with up to 4 uarts (eg m1280.)  Rather inelegantly.
  * Note that mega8/m32 still needs special handling, because ubrr is handled
@@ -421,145 +757,872 @@ static uint8_t eeprom_read(uint16_t addr) {
   return EEDR;
 }
 
-/* main program starts here */
-int main(void) {
-  uint8_t ch;
-
-  /*
-   * Making these local and in registers prevents the need for initializing
-   * them, and also saves space because code no longer stores to memory.
-   * (initializing address keeps the compiler happy, but isn't really
-   *  necessary, and uses 4 bytes of flash.)
-   */
-  register uint16_t address = 0;
-  register uint8_t  length;
+#ifdef EEPROM_FAST
+/*
+ * EEPROM data is written from buff in the background, a byte at a time
+ * whenever the previous one is done, while the reply goes out and the
+ * next command comes in.  Bytes that already hold the new value are
+ * skipped.  Any command other than STK_LOAD_ADDRESS waits for all of it
+ * to be written first, this also keeps it clear of SPM.
+ */
+static uint8_t *ee_ptr;
+static uint16_t ee_addr;
+static uint16_t ee_count;
+
+static void eeprom_poll(void) {
+  uint8_t old, val;
+
+  while (ee_count && eeprom_is_ready()) {
+    ee_count--;
+    val = *ee_ptr++;
+    old = eeprom_read(ee_addr);
+    if (old == val) {
+      ee_addr++;
+      continue;
+    }
 
-  // After the zero init loop, this is the first code to run.
-  //
-  // This code makes the following assumptions:
-  //  No interrupts will execute
-  //  SP points to RAMEND
-  //  r1 contains zero
-  //
-  // If not, uncomment the following instructions:
-  // cli();
-  asm volatile ("cli");
-  asm volatile ("clr __zero_reg__");
-#if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
-  SP=RAMEND;  // This is done by hardware reset
+#if defined(EEPM0)
+    /* Only erase, or only program the bits going to 0, when that's enough */
+    if (val == 0xff)
+      EECR = 1 << EEPM0;
+    else if (!(val & ~old))
+      EECR = 1 << EEPM1;
+    else
+      EECR = 0;
 #endif
+    EEAR = ee_addr++;
+    EEDR = val;
+    EECR |= 1 << EEMPE;	/* Write logical one to EEMPE */
+    EECR |= 1 << EEPE;	/* Start eeprom write by setting EEPE */
+  }
+}
 
-  /*
-   * With wireless flashing it's possible that this is a remote
-   * board that's hard to reset manually.  In this case optiboot can
-   * force the watchdog to run before jumping to userspace, so that if
-   * a buggy program is uploaded, the board resets automatically.  We
-   * still use the watchdog to reset the bootloader too.
-   */
-#ifdef FORCE_WATCHDOG
-  SP = RAMEND - 32;
-#define reset_cause (*(uint8_t *) (RAMEND - 16 - 4))
-#define marker (*(uint32_t *) (RAMEND - 16 - 3))
+static void eeprom_flush(void) {
+  while (ee_count) {
+    watchdogReset();
+    eeprom_poll();
+  }
 
-  /* GCC does loads Y with SP at the beginning, repeat it with the new SP */
-  asm volatile ("in r28, 0x3d");
-  asm volatile ("in r29, 0x3e");
+  /* SPM has to wait for the last byte too, and eeprom_write() is atomic */
+  while (!eeprom_is_ready());
+#if defined(EEPM0)
+  EECR = 0;
+#endif
+}
+#endif
 
-  ch = MCUSR;
-  MCUSR = 0;
-  if ((ch & _BV(WDRF)) && marker == 0xdeadbeef) {
-    marker = 0;
-    appStart(reset_cause);
-  }
-  /* Save the original reset reason to pass on to the applicatoin */
-  reset_cause = ch;
-  marker = 0xdeadbeef;
+/*
+ * Read a flash byte and increment the address.  On parts with RAMPZ it
+ * should already be set, elpm then also carries into RAMPZ.
+ */
+#if defined(RAMPZ)
+#define flash_read(ch, address) \
+  __asm__ ("elpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address))
 #else
-  // Adaboot no-wait mod
-  ch = MCUSR;
-  MCUSR = 0;
-  if (ch & (_BV(WDRF) | _BV(PORF) | _BV(BORF)))
-    appStart(ch);
+#define flash_read(ch, address) \
+  __asm__ ("lpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address))
 #endif
 
-#if BSS_SIZE > 0
-  // Prepare .data
-  asm volatile (
-	"	ldi	r17, hi8(__data_end)\n"
-	"	ldi	r26, lo8(__data_start)\n"
-	"	ldi	r27, hi8(__data_start)\n"
-	"	ldi	r30, lo8(__data_load_start)\n"
-	"	ldi	r31, hi8(__data_load_start)\n"
-	"	rjmp	cpchk\n"
-	"copy:	lpm	__tmp_reg__, Z+\n"
-	"	st	X+, __tmp_reg__\n"
-	"cpchk:	cpi	r26, lo8(__data_end)\n"
-	"	cpc	r27, r17\n"
-	"	brne	copy\n");
-  // Prepare .bss
-  asm volatile (
-	"	ldi	r17, hi8(__bss_end)\n"
-	"	ldi	r26, lo8(__bss_start)\n"
-	"	ldi	r27, hi8(__bss_start)\n"
-	"	rjmp	clchk\n"
-	"clear:	st	X+, __zero_reg__\n"
-	"clchk:	cpi	r26, lo8(__bss_end)\n"
-	"	cpc	r27, r17\n"
-	"	brne	clear\n");
-#endif
+#ifdef MANIFEST
+/* Set once the manifest has been marked stale in this session */
+static uint8_t manifest_stale;
 
-#if LED_START_FLASHES > 0
-  // Set up Timer 1 for timeout counter
-  TCCR1B = _BV(CS12) | _BV(CS10); // div 1024
-#endif
-  /*
-   * Disable pullups that may have been enabled by a user program.
-   * Somehow a pullup on RXD screws up everything unless RXD is externally
-   * driven high.
-   */
-  DDRD |= 3;
-  PORTD &= ~3;
-#if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
-  UCSRA = _BV(U2X); //Double speed mode USART
-  UCSRB = _BV(RXEN) | _BV(TXEN);  // enable Rx & Tx
-  UCSRC = _BV(URSEL) | _BV(UCSZ1) | _BV(UCSZ0);  // config USART; 8N1
-  UBRRL = (uint8_t)( (F_CPU + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
+/* Called before the first flash page is written */
+static void manifest_clear(void) {
+  if (manifest_stale)
+    return;
+  manifest_stale = 1;
+
+  /* No EEPROM write while SPM is busy and the other way round */
+  boot_spm_busy_wait();
+  eeprom_write(MANIFEST_EEPROM + 12, 0xff);
+  while (!eeprom_is_ready());
+}
 #else
-  UART_SRA = _BV(U2X0); //Double speed mode USART0
-  UART_SRB = _BV(RXEN0) | _BV(TXEN0);
-  UART_SRC = _BV(UCSZ00) | _BV(UCSZ01);
-  UART_SRL = (uint8_t)( (F_CPU + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
+#define manifest_clear()
 #endif
 
-  // Set up watchdog to trigger after 2s
-  watchdogConfig(WATCHDOG_2S);
+#ifdef RESUME
+/*
+ * Next page expected in order, 0xffff until STK_RESUME and 0xfffe once
+ * resume_clear() has run, neither of them a page number.
+ */
+static uint16_t resume_next = 0xffff;
 
-#if (LED_START_FLASHES > 0) || defined(LED_DATA_FLASH)
-  /* Set LED pin as output */
-  LED_DDR |= _BV(LED);
+/*
+ * Called before the first flash page is written.  Without STK_RESUME the
+ * pages are none of the record's business, so its id is erased for good.
+ */
+static void resume_clear(void) {
+  uint8_t i;
+
+  if (resume_next != 0xffff)
+    return;
+  resume_next = 0xfffe;
+
+  boot_spm_busy_wait();
+  for (i = 0; i < 4; i++)
+    eeprom_write(RESUME_EEPROM + i, 0xff);
+  while (!eeprom_is_ready());
+}
+#else
+#define resume_clear()
 #endif
 
-  flash_led(2);
-  if (!radio_init()) {
-    while (1);
-  }
+/*
+ * Once a flash write command has been parsed, before any of its data goes
+ * into the SPM page buffer: an EEPROM write in between would clear it.
+ */
+#define flash_session() do { manifest_clear(); resume_clear(); } while (0)
 
+#ifdef FLASH_PIPELINE
+/*
+ * RWW page writes aren't waited for, they finish while the next page
+ * comes in.  That page's erase then has to wait for SPM to be free, it's
+ * started from flash_poll() which runs while we wait for the radio.
+ */
+static uint8_t erase_pending;
+static uint16_t erase_address;
+
+static void flash_poll(void) {
+  if (erase_pending && !boot_spm_busy()) {
+    erase_pending = 0;
+    __boot_page_erase_short((uint16_t)(void*)erase_address);
+    stat_add(STAT_ERASE, 1);
+  }
+}
 
-#if LED_START_FLASHES > 0
-  /* Flash onboard LED to signal entering of bootloader */
-  flash_led(LED_START_FLASHES * 2);
+/* Wait for SPM to finish, including an erase that's still pending */
+static void flash_ready(void) {
+  boot_spm_busy_wait();
+  flash_poll();
+  boot_spm_busy_wait();
+}
+#else
+#define flash_ready() boot_spm_busy_wait()
 #endif
 
-  /* Forever loop */
-  for (;;) {
+/* Wait for SPM to finish and make the RWW section readable again */
+#if defined(RWWSRE)
+#define flash_idle() do { flash_ready(); boot_rww_enable(); } while (0)
+#else
+#define flash_idle() flash_ready()
+#endif
 
-    /* get character from UART */
-    ch = getch();
-    marker = 0;
+/*
+ * Programming a flash page is split around receiving its contents.  An
+ * RWW page can be erased straight away, while the data comes in.
+ */
+static void flash_erase_rww(uint16_t address) {
+  if (flash_rww(address)) {
+#ifdef FLASH_PIPELINE
+    erase_address = address;
+    erase_pending = 1;
+    flash_poll();
+#else
+    __boot_page_erase_short((uint16_t)(void*)address);
+    stat_add(STAT_ERASE, 1);
+#endif
+  }
+}
+
+#ifdef SKIP_UNCHANGED
+/* Set once the page being received differs from what's in flash */
+static uint8_t flash_diff;
+
+/*
+ * Compare every byte of a page with the old contents as it comes in.
+ * The RWW page erase waits for the first difference, until then the old
+ * contents can still be read, after that they're not needed.  If there
+ * is none, flash_write() has nothing to do.
+ */
+static void flash_cmp(uint16_t address, uint8_t offset, uint8_t ch) {
+  uint8_t old;
+
+  if (flash_diff)
+    return;
+
+#ifdef FLASH_PIPELINE
+  /* The previous page may still be being written */
+  if (boot_rww_busy())
+    flash_idle();
+#endif
+
+  /* Without the post-increment, that could carry into RAMPZ */
+#if defined(RAMPZ)
+  __asm__ ("elpm %0,Z\n" : "=r" (old) : "z" (address + offset));
+#else
+  __asm__ ("lpm %0,Z\n" : "=r" (old) : "z" (address + offset));
+#endif
+
+  if (old != ch) {
+    flash_diff = 1;
+    flash_erase_rww(address);
+  }
+}
+
+#define flash_begin(address) (flash_diff = 0)
+#else
+#define flash_cmp(address, offset, ch)
+#define flash_begin(address) flash_erase_rww(address)
+#endif
+
+#if !defined(RADIO_PAGE_STREAM) || defined(PROG_LZ) || defined(BIG_WRITE) || \
+    defined(SPM_SERVICE)
+/* Copy a page from RAM at bufPtr into the SPM page buffer */
+static void flash_fill(uint16_t address, uint8_t *bufPtr) {
+  uint16_t addrPtr;
+  uint8_t ch;
+
+#ifdef SKIP_UNCHANGED
+  if (!flash_diff)
+    return;
+#endif
+
+  // If only a partial page is to be programmed, the erase might not be complete.
+  // So check that here
+  flash_ready();
+
+  // Copy buffer into programming buffer
+  addrPtr = (uint16_t)(void*)address;
+  ch = SPM_PAGESIZE / 2;
+  do {
+    uint16_t a;
+    a = *bufPtr++;
+    a |= (*bufPtr++) << 8;
+    __boot_page_fill_short((uint16_t)(void*)addrPtr,a);
+    addrPtr += 2;
+  } while (--ch);
+}
+#endif
+
+#ifdef RESUME
+static void resume_mark(uint16_t address) {
+  uint16_t page = address / SPM_PAGESIZE;
+
+#ifdef RAMPZ
+  page += RAMPZ * (uint16_t) (0x10000 / SPM_PAGESIZE);
+#endif
+  if (page != resume_next)
+    return;
+
+  if (!(++resume_next & 7)) {
+    /* The page has to be in flash first, and no SPM during the write */
+    boot_spm_busy_wait();
+    eeprom_write(RESUME_EEPROM + 4 + (page >> 3), 0x00);
+    while (!eeprom_is_ready());
+  }
+}
+#else
+#define resume_mark(address)
+#endif
+
+/*
+ * The rest of it once the data is in the SPM page buffer, filled by
+ * flash_fill() or getpage().  An NRWW page is only erased now, after the
+ * fill, which the datasheet allows too.
+ */
+static void flash_write(uint16_t address) {
+#ifdef SKIP_UNCHANGED
+  if (!flash_diff) {
+#if defined(RWWSRE) && defined(RADIO_PAGE_STREAM)
+    /* Drop what getpage() put in the SPM page buffer */
+    boot_rww_enable();
+#endif
+    resume_mark(address);
+    return;
+  }
+#endif
+
+  // If we are in NRWW section, page erase has to be delayed until now.
+  if (!flash_rww(address)) {
+    __boot_page_erase_short((uint16_t)(void*)address);
+    stat_add(STAT_ERASE, 1);
+  }
+
+  flash_ready();
+
+  // Write from programming buffer
+  __boot_page_write_short((uint16_t)(void*)address);
+  stat_add(STAT_WRITE, 1);
+#ifdef FLASH_PIPELINE
+  /* Let an RWW page finish while the reply goes out */
+  if (flash_rww(address)) {
+    resume_mark(address);
+    return;
+  }
+#endif
+  boot_spm_busy_wait();
+
+#if defined(RWWSRE)
+  // Reenable read access to flash
+  boot_rww_enable();
+#endif
+  resume_mark(address);
+}
+
+#if (defined(PROG_MULTI) && !defined(RADIO_PAGE_STREAM)) || defined(PROG_LZ) || \
+    (defined(BIG_WRITE) && defined(SKIP_UNCHANGED))
+/* Compare a page in flash with bufPtr, non-zero if they differ */
+static uint8_t flash_verify(uint16_t address, uint8_t *bufPtr) {
+  uint8_t ch, n = (uint8_t) SPM_PAGESIZE;
+#ifdef RAMPZ
+  /* elpm carries into RAMPZ after the last byte below 64k */
+  uint8_t rampz = RAMPZ;
+#endif
+
+#ifdef FLASH_PIPELINE
+  flash_idle();
+#endif
+
+  do {
+    flash_read(ch, address);
+    if (ch != *bufPtr++)
+      break;
+  } while (--n);
+
+#ifdef RAMPZ
+  RAMPZ = rampz;
+#endif
+  return n;
+}
+#endif
+
+#ifdef BIG_WRITE
+/*
+ * STK_PROG_PAGE with more than a page of data: all of it is staged in
+ * buff and programmed page after page once the command is complete.  The
+ * erase can't overlap with receiving here, but the round trips for all
+ * but one page are gone.
+ */
+static uint8_t big_write(uint16_t address, uint16_t len, uint8_t type) {
+  uint8_t *bufPtr = buff, *end;
+
+  do *bufPtr++ = getch();
+  while (--len);
+  end = bufPtr;
+
+  // Read command terminator, start reply
+  if (verifySpace())
+    return 1;
+
+#ifdef FLASH_PIPELINE
+  flash_idle();
+#endif
+
+#ifdef SUPPORT_EEPROM
+  if (type == 'E') {
+#ifdef EEPROM_FAST
+    ee_ptr = buff;
+    ee_addr = address;
+    ee_count = end - buff;
+    eeprom_poll();
+#else
+    for (bufPtr = buff; bufPtr != end; bufPtr++) {
+      watchdogReset();
+      eeprom_write(address++, *bufPtr);
+    }
+#endif
+    return 0;
+  }
+#endif
+
+  for (bufPtr = buff; bufPtr < end; bufPtr += SPM_PAGESIZE) {
+    watchdogReset();
+#ifdef SKIP_UNCHANGED
+    flash_diff = flash_verify(address, bufPtr);
+    if (flash_diff)
+#endif
+      flash_erase_rww(address);
+    flash_fill(address, bufPtr);
+    flash_write(address);
+
+    address += SPM_PAGESIZE;
+#ifdef RAMPZ
+    if (!address)
+      RAMPZ++;
+#endif
+  }
+  return 0;
+}
+#endif
+
+#if defined(FLASH_HASH) || defined(MANIFEST) || defined(SPM_SERVICE)
+/* CRC-32 as in zlib and Ethernet, a bit at a time to save space */
+static uint32_t crc32_update(uint32_t crc, uint8_t data) {
+  uint8_t i;
+
+  crc ^= data;
+  for (i = 0; i < 8; i++)
+    crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+
+  return crc;
+}
+
+/* CRC-32 of count flash bytes from address on, RAMPZ already set */
+static uint32_t flash_crc32(uint16_t address, uint32_t count) {
+  uint32_t crc = 0xffffffff;
+  uint8_t ch;
+
+  while (count--) {
+    // read a Flash byte and increment the address (may increment RAMPZ)
+    flash_read(ch, address);
+    crc = crc32_update(crc, ch);
+    if (!(uint8_t) count)
+      watchdogReset();
+  }
+
+  return ~crc;
+}
+#endif
+
+#ifdef PROG_LZ
+/*
+ * Get a byte we already decompressed, dist bytes back from offset pos in
+ * the page at address.  If it's not in buff any more then it's in one of
+ * the pages written before and we read it back from flash, so the image
+ * itself is the dictionary and we don't need any more RAM.
+ */
+static uint8_t lz_byte(uint16_t address, uint8_t pos, uint16_t dist) {
+  uint8_t ch;
+#ifdef RAMPZ
+  uint8_t rampz = RAMPZ;
+#endif
+
+  if (dist <= pos)
+    return buff[pos - dist];
+
+  /*
+   * The current page may be being erased, the RWW section is unreadable.
+   * This comes before RAMPZ changes as it may start a pending erase.
+   */
+  flash_idle();
+
+  dist -= pos;
+#ifdef RAMPZ
+  if (dist > address)
+    RAMPZ--;
+#endif
+  address -= dist;
+
+  flash_read(ch, address);
+
+#ifdef RAMPZ
+  RAMPZ = rampz;
+#endif
+  return ch;
+}
+
+/*
+ * Decompress pages flash pages into flash from address on.  The stream
+ * is a sequence of:
+ *   0x00-0x7f  n + 1 literal bytes follow
+ *   0x80-0xff  two more bytes d (big endian, 0xfffe at most) follow, copy
+ *              (n & 0x7f) + 3 bytes from d + 1 bytes back, the copy may
+ *              overlap itself
+ * and it has to end exactly at the end of the last page.  Copies can
+ * reach back across page boundaries into anything decompressed so far.
+ * Returns the number of pages written, after a page fails to verify
+ * *fail is set and the rest of the stream is decoded but not written.
+ */
+static uint16_t lz_write(uint16_t address, uint16_t pages, uint8_t *fail) {
+  uint16_t done = 0, dist = 0;
+  uint8_t pos = 0, lit = 0, copy = 0, ch;
+
+  *fail = 0;
+  while (pages) {
+    if (!lit && !copy) {
+      ch = getch();
+      if (ch < 0x80)
+        lit = ch + 1;
+      else {
+        copy = (ch & 0x7f) + 3;
+        dist = getch() << 8;
+        dist |= getch();
+        dist++;
+      }
+    }
+
+    if (lit) {
+      ch = getch();
+      lit--;
+    } else {
+      ch = lz_byte(address, pos, dist);
+      copy--;
+    }
+
+    // If we are in RWW section, start the page erase once the page begins
+    if (!pos && !*fail)
+      flash_begin(address);
+    if (!*fail)
+      flash_cmp(address, pos, ch);
+
+    buff[pos] = ch;
+    if (++pos != (uint8_t) SPM_PAGESIZE)
+      continue;
+    pos = 0;
+
+    if (!*fail) {
+      flash_fill(address, buff);
+      flash_write(address);
+      *fail = flash_verify(address, buff);
+      if (!*fail)
+        done++;
+    }
+
+    address += SPM_PAGESIZE;
+#ifdef RAMPZ
+    if (!address)
+      RAMPZ++;
+#endif
+    pages--;
+  }
+
+  return done;
+}
+#endif
+
+#ifdef SPM_SERVICE
+#if defined(MANIFEST) || defined(RESUME)
+/*
+ * The flash changes under the EEPROM records.  The application's RAM
+ * isn't ours, so unlike manifest_clear() and resume_clear() this goes
+ * by the EEPROM contents alone.  The MANIFEST only goes stale if the
+ * page is part of the recorded image, the application may well keep
+ * data or its next image in the rest of the flash.  This is done on the
+ * erase, which comes before the page buffer is filled: an EEPROM write
+ * between the fill and the page write would clear the buffer.
+ */
+static void spm_records(uint16_t address) {
+#ifdef MANIFEST
+  uint32_t size = 0, at = address & ~(SPM_PAGESIZE - 1);
+#endif
+  uint8_t i;
+
+#if defined(EEPM0)
+  /* Atomic erase and write, whatever mode the application left it in */
+  while (!eeprom_is_ready());
+  EECR &= ~(_BV(EEPM1) | _BV(EEPM0));
+#endif
+#ifdef MANIFEST
+#ifdef RAMPZ
+  at |= (uint32_t) RAMPZ << 16;
+#endif
+  for (i = 0; i < 4; i++)
+    size = (size << 8) | eeprom_read(MANIFEST_EEPROM + i);
+  if (at < size && eeprom_read(MANIFEST_EEPROM + 12) != 0xff)
+    eeprom_write(MANIFEST_EEPROM + 12, 0xff);
+#endif
+#ifdef RESUME
+  for (i = 0; i < 4; i++)
+    if (eeprom_read(RESUME_EEPROM + i) != 0xff)
+      eeprom_write(RESUME_EEPROM + i, 0xff);
+#endif
+  while (!eeprom_is_ready());
+}
+#else
+#define spm_records(address)
+#endif
+
+/*
+ * SPM for the application, which can't run it itself.  It calls this
+ * through the rjmp at the start of the bootloader + 2 with interrupts
+ * disabled and RAMPZ set, command being __BOOT_PAGE_FILL, _ERASE or
+ * _WRITE from boot.h.  A page has to be erased before it's filled, then
+ * written.  Erasing or writing the NRWW section, and with it the
+ * bootloader, is refused.
+ */
+static void do_spm(uint16_t address, uint8_t command, uint16_t data)
+  __attribute__ ((used, noinline));
+static void do_spm(uint16_t address, uint8_t command, uint16_t data) {
+  boot_spm_busy_wait();
+
+  if (command == __BOOT_PAGE_FILL) {
+    __boot_page_fill_short((uint16_t)(void*)address, data);
+    return;
+  }
+  if (!flash_rww(address))
+    return;
+
+  if (command == __BOOT_PAGE_ERASE) {
+    spm_records(address);
+    __boot_page_erase_short((uint16_t)(void*)address);
+  } else if (command == __BOOT_PAGE_WRITE)
+    __boot_page_write_short((uint16_t)(void*)address);
+  boot_spm_busy_wait();
+#if defined(RWWSRE)
+  boot_rww_enable();
+#endif
+}
+
+/* Right before main(), so that the rjmp to do_spm() never moves */
+void pre_main(void) __attribute__ ((naked)) __attribute__ ((section (".init8")));
+void pre_main(void) {
+  asm volatile (
+	"	rjmp	1f\n"
+	"	rjmp	do_spm\n"
+	"1:\n");
+}
+
+/* Select a flash page, returns its address in the 64k bank in RAMPZ */
+static uint16_t page_select(uint16_t page) {
+#ifdef RAMPZ
+  RAMPZ = page / (uint16_t) (0x10000 / SPM_PAGESIZE);
+#endif
+  return page * SPM_PAGESIZE;
+}
+
+/* Pages below the NRWW section, the most an image can have */
+#ifdef NRWW_RAMPZ
+#define RWW_PAGES ((NRWW_RAMPZ * 0x10000UL + NRWWSTART) / SPM_PAGESIZE)
+#else
+#define RWW_PAGES (NRWWSTART / SPM_PAGESIZE)
+#endif
+#define FLASH_PAGES ((FLASHEND + 1UL) / SPM_PAGESIZE)
+
+/*
+ * Copy the image the application has staged into place, from page 0 on.
+ * The request is only dropped once it's all copied, so if we lose power
+ * half way through, the copy starts over on the next reset.  A request
+ * for more than the RWW section holds, with its source overlapping the
+ * destination or past the end of the flash, or whose staged copy doesn't
+ * match the length and CRC-32 in it, is dropped and the old image stays.
+ * The MANIFEST and RESUME records go stale as for an upload, and
+ * once the copy checks out the MANIFEST record is the staged one.
+ */
+static void stage_copy(void) {
+  uint16_t count, src, dst = 0, address;
+  uint32_t size = 0, crc = 0;
+  uint8_t *bufPtr, length, ch;
+
+  count = (eeprom_read(STAGE_EEPROM) << 8) | eeprom_read(STAGE_EEPROM + 1);
+  src = (eeprom_read(STAGE_EEPROM + 2) << 8) | eeprom_read(STAGE_EEPROM + 3);
+  for (ch = 0; ch < 4; ch++) {
+    size = (size << 8) | eeprom_read(STAGE_EEPROM + 4 + ch);
+    crc = (crc << 8) | eeprom_read(STAGE_EEPROM + 8 + ch);
+  }
+
+  if (count > RWW_PAGES || src < count || src > FLASH_PAGES - count ||
+      size > (uint32_t) count * SPM_PAGESIZE ||
+      flash_crc32(page_select(src), size) != crc)
+    count = 0;
+  if (count)
+    flash_session();
+
+  while (count--) {
+    watchdogReset();
+    flash_idle();
+
+    address = page_select(src++);
+    bufPtr = buff;
+    length = (uint8_t) SPM_PAGESIZE;
+    do {
+      flash_read(ch, address);
+      *bufPtr++ = ch;
+    } while (--length);
+
+    address = page_select(dst++);
+#ifdef SKIP_UNCHANGED
+    flash_diff = 1;
+#endif
+    flash_erase_rww(address);
+    flash_fill(address, buff);
+    flash_write(address);
+  }
+  flash_idle();
+
+#ifdef MANIFEST
+  if (dst && flash_crc32(page_select(0), size) == crc) {
+    for (ch = 0; ch < 12; ch++)
+      eeprom_write(MANIFEST_EEPROM + ch, eeprom_read(STAGE_EEPROM + 4 + ch));
+    eeprom_write(MANIFEST_EEPROM + 12, 0x00);
+  }
+#endif
+  eeprom_write(STAGE_EEPROM, 0xff);
+  while (!eeprom_is_ready());
+}
+#endif
+
+/* main program starts here */
+int main(void) {
+  uint8_t ch;
+
+  /*
+   * Making these local and in registers prevents the need for initializing
+   * them, and also saves space because code no longer stores to memory.
+   * (initializing address keeps the compiler happy, but isn't really
+   *  necessary, and uses 4 bytes of flash.)
+   */
+  register uint16_t address = 0;
+  register uint8_t  length;
+#ifdef RADIO_SURVEY
+  /* Channel to move to after the current reply, 0xff for none */
+  uint8_t channel = 0xff;
+#endif
+#ifdef RADIO_RATE_FALLBACK
+  /* Air data rate to change to after the current reply, 0xff for none */
+  uint8_t rate = 0xff;
+#endif
+
+  // After the zero init loop, this is the first code to run.
+  //
+  // This code makes the following assumptions:
+  //  No interrupts will execute
+  //  SP points to RAMEND
+  //  r1 contains zero
+  //
+  // If not, uncomment the following instructions:
+  // cli();
+  asm volatile ("cli");
+  asm volatile ("clr __zero_reg__");
+#if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
+  SP=RAMEND;  // This is done by hardware reset
+#endif
+
+  /*
+   * With wireless flashing it's possible that this is a remote
+   * board that's hard to reset manually.  In this case optiboot can
+   * force the watchdog to run before jumping to userspace, so that if
+   * a buggy program is uploaded, the board resets automatically.  We
+   * still use the watchdog to reset the bootloader too.
+   */
+#ifdef FORCE_WATCHDOG
+  SP = RAMEND - 32;
+#define reset_cause (*(uint8_t *) (RAMEND - 16 - 4))
+#define marker (*(uint32_t *) (RAMEND - 16 - 3))
+
+  /* GCC does loads Y with SP at the beginning, repeat it with the new SP */
+  asm volatile ("in r28, 0x3d");
+  asm volatile ("in r29, 0x3e");
+
+  ch = MCUSR;
+  MCUSR = 0;
+  if ((ch & _BV(WDRF)) && marker == 0xdeadbeef && app_ready()) {
+    marker = 0;
+    appStart(reset_cause);
+  }
+  /* Save the original reset reason to pass on to the applicatoin */
+  reset_cause = ch;
+  marker = 0xdeadbeef;
+#else
+  // Adaboot no-wait mod
+  ch = MCUSR;
+  MCUSR = 0;
+  if ((ch & (_BV(WDRF) | _BV(PORF) | _BV(BORF))) && app_ready())
+    appStart(ch);
+#endif
+
+#if BSS_SIZE > 0
+  // Prepare .data
+  asm volatile (
+	"	ldi	r17, hi8(__data_end)\n"
+	"	ldi	r26, lo8(__data_start)\n"
+	"	ldi	r27, hi8(__data_start)\n"
+	"	ldi	r30, lo8(__data_load_start)\n"
+	"	ldi	r31, hi8(__data_load_start)\n"
+	"	rjmp	cpchk\n"
+	"copy:	lpm	__tmp_reg__, Z+\n"
+	"	st	X+, __tmp_reg__\n"
+	"cpchk:	cpi	r26, lo8(__data_end)\n"
+	"	cpc	r27, r17\n"
+	"	brne	copy\n");
+  // Prepare .bss
+  asm volatile (
+	"	ldi	r17, hi8(__bss_end)\n"
+	"	ldi	r26, lo8(__bss_start)\n"
+	"	ldi	r27, hi8(__bss_start)\n"
+	"	rjmp	clchk\n"
+	"clear:	st	X+, __zero_reg__\n"
+	"clchk:	cpi	r26, lo8(__bss_end)\n"
+	"	cpc	r27, r17\n"
+	"	brne	clear\n");
+#endif
+
+#ifdef SPM_SERVICE
+  /* Put a staged image in place and start it, through the watchdog */
+  if (stage_pending()) {
+    watchdogConfig(WATCHDOG_2S);
+    stage_copy();
+    watchdogConfig(WATCHDOG_16MS);
+    while (1);
+  }
+#endif
+
+#ifdef TIMER
+  // Start the radio timebase, flash_led() uses it too
+  timer_init();
+#elif LED_START_FLASHES > 0
+  // Set up Timer 1 for timeout counter
+  TCCR1B = _BV(CS12) | _BV(CS10); // div 1024
+#endif
+  /*
+   * Disable pullups that may have been enabled by a user program.
+   * Somehow a pullup on RXD screws up everything unless RXD is externally
+   * driven high.
+   */
+  DDRD |= 3;
+  PORTD &= ~3;
+#if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
+  UCSRA = _BV(U2X); //Double speed mode USART
+  UCSRB = _BV(RXEN) | _BV(TXEN);  // enable Rx & Tx
+  UCSRC = _BV(URSEL) | _BV(UCSZ1) | _BV(UCSZ0);  // config USART; 8N1
+  UBRRL = (uint8_t)( (F_CPU + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
+#else
+  UART_SRA = _BV(U2X0); //Double speed mode USART0
+  UART_SRB = _BV(RXEN0) | _BV(TXEN0);
+  UART_SRC = _BV(UCSZ00) | _BV(UCSZ01);
+  UART_SRL = (uint8_t)( (F_CPU + BAUD_RATE * 4L) / (BAUD_RATE * 8L) - 1 );
+#endif
+
+  // Set up watchdog to trigger after 2s
+  watchdogConfig(WATCHDOG_2S);
+
+#if (LED_START_FLASHES > 0) || defined(LED_DATA_FLASH)
+  /* Set LED pin as output */
+  LED_DDR |= _BV(LED);
+#endif
+
+#if LED_START_FLASHES > 0
+  flash_led(2);
+#endif
+  if (!radio_init()) {
+    while (1);
+  }
+
+#ifdef RADIO_PROBE
+  /* No gateway, let the watchdog start the application right away */
+  if (!radio_probe())
+    wait_timeout();
+#endif
+
+
+#if LED_START_FLASHES > 0
+  /* Flash onboard LED to signal entering of bootloader */
+  flash_led(LED_START_FLASHES * 2);
+#endif
+
+  /* Forever loop */
+  for (;;) {
+
+    /* get character from UART */
+    ch = getch();
+    marker = 0;
+
+#ifdef EEPROM_FAST
+    /* STK_PROG_PAGE overwrites buff, the rest may read the EEPROM */
+    if (ch != STK_LOAD_ADDRESS)
+      eeprom_flush();
+#endif
+
+#ifdef FLASH_PIPELINE
+    /* Only the next page write may overlap the previous one */
+    if (ch != STK_PROG_PAGE && ch != STK_LOAD_ADDRESS)
+      flash_idle();
+#endif
 
     if(ch == STK_GET_PARAMETER) {
       unsigned char which = getch();
-      verifySpace();
+      verify_or_resync();
       if (which == 0x82) {
         /*
         * Send optiboot version as "minor SW version"
@@ -567,6 +1630,18 @@ int main(void) {
 	      putch(OPTIBOOT_MINVER);
       } else if (which == 0x81) {
 	       putch(OPTIBOOT_MAJVER);
+#ifdef RADIO_SURVEY
+      } else if (which == Parm_RADIO_CHANNEL) {
+        raw_reply(1);
+        putch(radio_quiet);
+        raw_reply(0);
+#endif
+#ifdef RADIO_STATS
+      } else if ((uint8_t) (which - Parm_RADIO_STATS) < sizeof(radio_stats)) {
+        raw_reply(1);
+        putch(((uint8_t *) radio_stats)[which - Parm_RADIO_STATS]);
+        raw_reply(0);
+#endif
       } else {
         /*
         * GET PARAMETER returns a generic 0x03 reply for
@@ -575,13 +1650,40 @@ int main(void) {
       	putch(0x03);
       }
     }
+#if defined(RADIO_SURVEY) || defined(RADIO_RATE_FALLBACK)
+    else if(ch == STK_SET_PARAMETER) {
+      unsigned char which = getch();
+      ch = getch();
+      verify_or_resync();
+      /* Only move once the gateway has our STK_OK, see below */
+#ifdef RADIO_SURVEY
+      if (which == Parm_RADIO_CHANNEL) {
+        /* The nRF24L01+ has channels 0 to 125 */
+        if (ch > 125)
+          putch(STK_FAILED);
+        else
+          channel = ch;
+      }
+#endif
+#ifdef RADIO_RATE_FALLBACK
+      if (which == Parm_RADIO_RATE) {
+        if (ch > 2)
+          putch(STK_FAILED);
+        else
+          rate = ch;
+      }
+#endif
+    }
+#endif
     else if(ch == STK_SET_DEVICE) {
       // SET DEVICE is ignored
       getNch(20);
+      verify_or_resync();
     }
     else if(ch == STK_SET_DEVICE_EXT) {
       // SET DEVICE EXT is ignored
       getNch(5);
+      verify_or_resync();
     }
     else if(ch == STK_LOAD_ADDRESS) {
       // LOAD ADDRESS
@@ -594,76 +1696,101 @@ int main(void) {
 #endif
       newAddress <<= 1; // Convert from word address to byte address
       address = newAddress;
-      verifySpace();
+      verify_or_resync();
     }
     else if(ch == STK_UNIVERSAL) {
       // UNIVERSAL command is ignored
       getNch(4);
+      verify_or_resync();
       putch(0x00);
     }
     /* Write memory, length is big endian and is in bytes */
     else if(ch == STK_PROG_PAGE) {
       // PROGRAM PAGE - we support flash and EEPROM programming
       uint8_t *bufPtr;
+#if defined(SUPPORT_EEPROM) && !defined(EEPROM_FAST)
       uint16_t addrPtr;
+#endif
       uint8_t type;
+#ifdef BIG_WRITE
+      uint16_t len;
+#endif
 
+#ifdef BIG_WRITE
+      len = getch() << 8;	/* getlen() */
+      len |= getch();
+      length = len;
+#else
       getch();			/* getlen() */
       length = getch();
+#endif
       type = getch();
+#ifdef SUPPORT_EEPROM
+      if (type == 'F')
+#endif
+        flash_session();
+
+#ifdef BIG_WRITE
+      if (len > BUFF_SIZE) {
+        /* More than buff holds, drop the data and refuse the write */
+        do getch();
+        while (--len);
+        verify_or_resync();
+        putch(STK_FAILED);
+      } else if (len > SPM_PAGESIZE) {
+        if (big_write(address, len, type))
+          continue;		/* resync() */
+      } else {
+#endif
 
 #ifdef SUPPORT_EEPROM
       if (type == 'F')		/* Flash */
 #endif
         // If we are in RWW section, immediately start page erase
-        if (address < NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
+        flash_begin(address);
 
       // While that is going on, read in page contents
-      bufPtr = buff;
-      do *bufPtr++ = getch();
-      while (--length);
-
-#ifdef SUPPORT_EEPROM
-      if (type == 'F') {	/* Flash */
+#ifdef RADIO_PAGE_STREAM
+      if (type == 'F')
+        getpage((uint16_t)(void*)address, length);
+      else
 #endif
-        // If we are in NRWW section, page erase has to be delayed until now.
-        // Todo: Take RAMPZ into account (not doing so just means that we will
-        //  treat the top of both "pages" of flash as NRWW, for a slight speed
-        //  decrease, so fixing this is not urgent.)
-        if (address >= NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
-
-        // Read command terminator, start reply
-        verifySpace();
-
-        // If only a partial page is to be programmed, the erase might not be complete.
-        // So check that here
-        boot_spm_busy_wait();
-
-        // Copy buffer into programming buffer
+      {
         bufPtr = buff;
-        addrPtr = (uint16_t)(void*)address;
-        ch = SPM_PAGESIZE / 2;
         do {
-          uint16_t a;
-          a = *bufPtr++;
-          a |= (*bufPtr++) << 8;
-          __boot_page_fill_short((uint16_t)(void*)addrPtr,a);
-          addrPtr += 2;
-        } while (--ch);
+          ch = getch();
+#if defined(SKIP_UNCHANGED) && defined(SUPPORT_EEPROM)
+          if (type == 'F')
+#endif
+            flash_cmp(address, bufPtr - buff, ch);
+          *bufPtr++ = ch;
+        } while (--length);
+      }
 
-        // Write from programming buffer
-        __boot_page_write_short((uint16_t)(void*)address);
-        boot_spm_busy_wait();
+#ifdef SUPPORT_EEPROM
+      if (type == 'F') {	/* Flash */
+#endif
+        // Read command terminator, start reply
+        verify_or_resync();
 
-#if defined(RWWSRE)
-        // Reenable read access to flash
-        boot_rww_enable();
+#ifndef RADIO_PAGE_STREAM
+        flash_fill(address, buff);
 #endif
+        flash_write(address);
 #ifdef SUPPORT_EEPROM
       } else if (type == 'E') {	/* EEPROM */
         // Read command terminator, start reply
-        verifySpace();
+        verify_or_resync();
+#ifdef FLASH_PIPELINE
+        flash_idle();
+#endif
 
+#ifdef EEPROM_FAST
+        ee_ptr = buff;
+        ee_addr = address;
+        ee_count = bufPtr - buff;
+        eeprom_poll();
+#else
         length = bufPtr - buff;
         addrPtr = address;
         bufPtr = buff;
@@ -671,48 +1798,337 @@ int main(void) {
           watchdogReset();
           eeprom_write(addrPtr++, *bufPtr++);
         }
+#endif
+      }
+#endif
+#ifdef BIG_WRITE
+      }
+#endif
+    }
+#ifdef PROG_MULTI
+    /*
+     * Write a run of whole flash pages from the current address on, with
+     * one report per window of pages instead of a round trip per page.
+     * The command is STK_PROG_MULTI, page count (big endian), pages per
+     * window (0 means 256), CRC_EOP, followed by the page data back to
+     * back.  After each window and after the last page we reply STK_OK or
+     * STK_FAILED, then the number of pages written so far (big endian),
+     * then STK_OK, with STK_INSYNC in front of all but the first report.
+     * After a failure, page "written so far" is the one that didn't
+     * verify and the rest of the data is only read and dropped.
+     */
+    else if(ch == STK_PROG_MULTI) {
+      uint16_t pages, done = 0;
+      uint8_t window, n, fail = 0;
+#ifndef RADIO_PAGE_STREAM
+      uint8_t *bufPtr;
+#endif
+
+      pages = getch() << 8;
+      pages |= getch();
+      window = getch();
+      verify_or_resync();
+      flash_session();
+
+      for (;;) {
+        n = window;
+        do {
+          if (!pages)
+            break;
+
+          if (fail) {
+            length = (uint8_t) SPM_PAGESIZE;
+            do getch();
+            while (--length);
+          } else {
+            flash_begin(address);
+#ifdef RADIO_PAGE_STREAM
+            getpage((uint16_t)(void*)address, (uint8_t) SPM_PAGESIZE);
+            flash_write(address);
+#else
+            bufPtr = buff;
+            length = (uint8_t) SPM_PAGESIZE;
+            do {
+              ch = getch();
+              flash_cmp(address, bufPtr - buff, ch);
+              *bufPtr++ = ch;
+            } while (--length);
+
+            flash_fill(address, buff);
+            flash_write(address);
+            fail = flash_verify(address, buff);
+#endif
+            if (!fail)
+              done++;
+          }
+
+          address += SPM_PAGESIZE;
+#ifdef RAMPZ
+          if (!address)
+            RAMPZ++;
+#endif
+          pages--;
+        } while (--n);
+
+        /* The status isn't the STK_OK that ends the reply */
+        raw_reply(1);
+        putch(fail ? STK_FAILED : STK_OK);
+        putch(done >> 8);
+        putch(done);
+        raw_reply(0);
+        if (!pages)
+          break;
+
+        putch(STK_OK);
+        putch(STK_INSYNC);
+      }
+    }
+#endif
+#ifdef PROG_LZ
+    /*
+     * Write flash pages from a compressed stream, see lz_write().  The
+     * command is STK_PROG_LZ, page count (big endian), CRC_EOP, followed
+     * by the stream.  The reply is STK_OK or STK_FAILED and the number
+     * of pages written (big endian), same as STK_PROG_MULTI.
+     */
+    else if(ch == STK_PROG_LZ) {
+      uint16_t pages, done;
+      uint8_t fail;
+
+      pages = getch() << 8;
+      pages |= getch();
+      verify_or_resync();
+      flash_session();
+
+      done = lz_write(address, pages, &fail);
+      address += pages * SPM_PAGESIZE;
+
+      raw_reply(1);
+      putch(fail ? STK_FAILED : STK_OK);
+      putch(done >> 8);
+      putch(done);
+      raw_reply(0);
+    }
+#endif
+#ifdef PAGE_CRC
+    /*
+     * CRC every flash page in a range, so that the host can tell which
+     * pages of a new image differ and only send those.  The command is
+     * STK_PAGE_CRC, page count (big endian), CRC_EOP, the pages start at
+     * the current address.  The reply is a CRC-16 (MODBUS: polynomial
+     * 0xa001 reflected, initial value 0xffff) per page, big endian.
+     */
+    else if(ch == STK_PAGE_CRC) {
+      uint16_t pages, crc;
+
+      pages = getch() << 8;
+      pages |= getch();
+      verify_or_resync();
+
+      raw_reply(1);
+      while (pages--) {
+        crc = 0xffff;
+        length = (uint8_t) SPM_PAGESIZE;
+        do {
+          // read a Flash byte and increment the address (may increment RAMPZ)
+          flash_read(ch, address);
+          crc = _crc16_update(crc, ch);
+        } while (--length);
+        watchdogReset();
+
+        putch(crc >> 8);
+        putch(crc);
+      }
+      raw_reply(0);
+    }
+#endif
+#ifdef RESUME
+    /*
+     * Continue an upload after a reset: the command is STK_RESUME, image
+     * id (4 bytes), CRC_EOP.  If the id is the one of the last upload,
+     * the reply is the number of pages from the start of the flash that
+     * it had written, big endian, otherwise the id is stored, the count
+     * starts over and the reply is 0.  Either way the following page
+     * writes, in order from there on, are recorded.
+     */
+    else if(ch == STK_RESUME) {
+      uint8_t i, id, diff = 0, erased = 0xff;
+
+      for (i = 0; i < 4; i++)
+        buff[i] = getch();
+      verify_or_resync();
+
+      for (i = 0; i < 4; i++) {
+        id = eeprom_read(RESUME_EEPROM + i);
+        diff |= buff[i] ^ id;
+        erased &= id;
       }
+      /* An id erased by resume_clear() matches nothing */
+      if (erased == 0xff)
+        diff = 1;
+
+      resume_next = 0;
+      if (diff) {
+        /*
+         * Clear the old progress from the end back, so that a reset
+         * halfway leaves the old id with only pages it really had, and
+         * store the new id last.
+         */
+        i = RESUME_BYTES;
+        do {
+          watchdogReset();
+          if (eeprom_read(RESUME_EEPROM + 3 + i) != 0xff)
+            eeprom_write(RESUME_EEPROM + 3 + i, 0xff);
+        } while (--i);
+        for (i = 0; i < 4; i++)
+          eeprom_write(RESUME_EEPROM + i, buff[i]);
+      } else
+        for (i = 0; i < RESUME_BYTES; i++) {
+          if (eeprom_read(RESUME_EEPROM + 4 + i))
+            break;
+          resume_next += 8;
+        }
+      while (!eeprom_is_ready());
+
+      raw_reply(1);
+      putch(resume_next >> 8);
+      putch(resume_next);
+      raw_reply(0);
+    }
 #endif
+#ifdef FLASH_HASH
+    /*
+     * Verify a whole image without reading it back: the command is
+     * STK_FLASH_HASH, byte count (4 bytes, big endian), CRC_EOP and the
+     * reply is the CRC-32 of that much flash from the current address
+     * on, big endian.  STK_READ_PAGE is still there for debugging.
+     */
+    else if(ch == STK_FLASH_HASH) {
+      uint32_t count, crc;
+
+      count = (uint32_t) getch() << 24;
+      count |= (uint32_t) getch() << 16;
+      count |= (uint16_t) getch() << 8;
+      count |= getch();
+      verify_or_resync();
+
+      crc = flash_crc32(address, count);
+
+      raw_reply(1);
+      putch(crc >> 24);
+      putch(crc >> 16);
+      putch(crc >> 8);
+      putch(crc);
+      raw_reply(0);
+    }
+#endif
+#ifdef MANIFEST
+    /*
+     * The image manifest: STK_MANIFEST, 'R', CRC_EOP returns the 12 bytes
+     * of the last one written and the byte that's 0x00 while the flash
+     * still holds that image.  STK_MANIFEST, 'W', length, CRC-32 (both 4
+     * bytes, big endian), build id (4 bytes), CRC_EOP stores a new one,
+     * if the CRC-32 of length bytes of flash from 0 on matches, and
+     * returns STK_OK, or STK_FAILED if it doesn't.
+     */
+    else if(ch == STK_MANIFEST) {
+      uint8_t i, type = getch();
+
+      if (type == 'W')
+        for (i = 0; i < 12; i++)
+          buff[i] = getch();
+      verify_or_resync();
+
+      if (type == 'W') {
+        uint32_t count = 0, crc = 0;
+
+        for (i = 0; i < 4; i++) {
+          count = (count << 8) | buff[i];
+          crc = (crc << 8) | buff[4 + i];
+        }
+#ifdef RAMPZ
+        RAMPZ = 0;
+#endif
+        if (flash_crc32(0, count) != crc) {
+          putch(STK_FAILED);
+        } else {
+          for (i = 0; i < 12; i++)
+            eeprom_write(MANIFEST_EEPROM + i, buff[i]);
+          eeprom_write(MANIFEST_EEPROM + 12, 0x00);
+          while (!eeprom_is_ready());
+          /* Any more writes make it stale again */
+          manifest_stale = 0;
+          putch(STK_OK);
+        }
+      } else {
+        raw_reply(1);
+        for (i = 0; i < 13; i++)
+          putch(eeprom_read(MANIFEST_EEPROM + i));
+        raw_reply(0);
+      }
     }
+#endif
     /* Read memory block mode, length is big endian.  */
     else if(ch == STK_READ_PAGE) {
       // READ PAGE - we only read flash and EEPROM
       uint8_t type;
+#ifdef BULK_READ
+      uint16_t len;
 
+      len = getch() << 8;	/* getlen() */
+      len |= getch();
+#else
       getch();			/* getlen() */
       length = getch();
+#endif
       type = getch();
 
-      verifySpace();
+      verify_or_resync();
+#ifdef BULK_READ
+      /* Full payloads only, whatever bytes the data contains */
+      tx_raw = 1;
+#ifdef SUPPORT_EEPROM
+      if (type == 'F')
+#endif
+        while (len--) {
+          flash_read(ch, address);
+          putch(ch);
+          if (!(uint8_t) len)
+            watchdogReset();
+        }
+#ifdef SUPPORT_EEPROM
+      else if (type == 'E')
+        while (len--) {
+          putch(eeprom_read(address++));
+          if (!(uint8_t) len)
+            watchdogReset();
+        }
+#endif
+      tx_raw = 0;
+#else
       /* TODO: putNch */
 #ifdef SUPPORT_EEPROM
       if (type == 'F')
 #endif
         do {
-#if defined(RAMPZ)
-          // Since RAMPZ should already be set, we need to use EPLM directly.
-          // Also, we can use the autoincrement version of lpm to update "address"
+          // We can use the autoincrement version of lpm to update "address"
           //      do putch(pgm_read_byte_near(address++));
           //      while (--length);
-          // read a Flash and increment the address (may increment RAMPZ)
-          __asm__ ("elpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address));
-#else
-          // read a Flash byte and increment the address
-          __asm__ ("lpm %0,Z+\n" : "=r" (ch), "=z" (address): "1" (address));
-#endif
+          flash_read(ch, address);
           putch(ch);
         } while (--length);
 #ifdef SUPPORT_EEPROM
       else if (type == 'E')
         while (length--)
           putch(eeprom_read(address++));
+#endif
 #endif
     }
 
     /* Get device signature bytes  */
     else if(ch == STK_READ_SIGN) {
       // READ SIGN - return what Avrdude wants to hear
-      verifySpace();
+      verify_or_resync();
       putch(SIGNATURE_0);
       putch(SIGNATURE_1);
       putch(SIGNATURE_2);
@@ -721,13 +2137,31 @@ int main(void) {
       // Adaboot no-wait mod
       marker = 0xdeadbeef;
       watchdogConfig(WATCHDOG_16MS);
-      verifySpace();
+      verify_or_resync();
     }
     else {
       // This covers the response to commands like STK_ENTER_PROGMODE
-      verifySpace();
+      verify_or_resync();
     }
     putch(STK_OK);
+
+#ifdef RADIO_SURVEY
+    if (channel != 0xff) {
+#ifdef RADIO_ACK_PAYLOAD
+      /* The STK_OK leaves in the ACK to the gateway's next poll */
+      while (!nrf24_tx_empty() && !drop_polls());
+#endif
+      nrf24_set_channel(channel);
+      channel = 0xff;
+    }
+#endif
+#ifdef RADIO_RATE_FALLBACK
+    /* The STK_OK is out, radio_send() waited for its ACK */
+    if (rate != 0xff) {
+      nrf24_set_rate(rate);
+      rate = 0xff;
+    }
+#endif
   }
 }
 
@@ -756,6 +2190,10 @@ static int radio_init(void) {
   if (!radio_present)
     return 0;
 
+#ifdef RADIO_SURVEY
+  radio_quiet = nrf24_survey();
+#endif
+
   addr[0] = 0x02;
   addr[1] = 0x02;
   addr[2] = 0x02;
@@ -774,77 +2212,448 @@ static int radio_init(void) {
   return 1;
 }
 
+#ifdef RADIO_PROBE
+/*
+ * See whether a gateway is around before keeping the application waiting
+ * for the watchdog.  We send a beacon, a 1-byte 0xff packet like the one
+ * the gateway sends to wake boards up, and if it's ACKed the gateway is
+ * listening.  If not, we still listen for RADIO_PROBE_MS in case the
+ * gateway is about to send rather than listening.
+ */
+static uint8_t radio_probe(void) {
+  uint8_t beacon = 0xff, status;
+  uint16_t ms = RADIO_PROBE_MS;
+
+  nrf24_tx_start();
+  nrf24_tx_push(&beacon, 1);
+  status = nrf24_tx_event();
+  stat_add(STAT_TX, 1);
+  if (status & (1 << MAX_RT))
+    stat_add(STAT_MAX_RT, 1);
+  if (!(status & (1 << TX_DS)))
+    nrf24_tx_flush();
+  nrf24_tx_end();
+
+  if (status & (1 << TX_DS))
+    return 1;
+
+  do {
+    if (nrf24_rx_fifo_data())
+      return 1;
+    my_delay(1);
+  } while (--ms);
+
+  return 0;
+}
+#endif
+
+/*
+ * Send one packet to the gateway.  Packets are queued in the chip and
+ * go out while we carry on, until one marked as the last of a reply.
+ */
+static void radio_send(uint8_t *buf, uint8_t len, uint8_t last) {
+#ifdef RADIO_ACK_PAYLOAD
+  /*
+   * Leave the packet in the Tx FIFO, the gateway picks it up with the
+   * ACK to its next packet and keeps sending empty "poll" packets until
+   * it has the whole reply.  We only need to wait when the FIFO is full
+   * and while doing that the polls have to be dropped from the Rx FIFO
+   * or the chip stops ACKing them once that fills up too.  If the gateway
+   * has moved on to the next command there's no point waiting any more,
+   * its packets would only pile up behind the polls until the watchdog
+   * bites, so the rest of this reply is dropped.
+   */
+  while (nrf24_ack_payload(1, buf, len))
+    if (drop_polls())
+      return;
+  stat_add(STAT_TX, 1);
+#else
+  static uint8_t in_tx = 0;
+
+  if (!in_tx) {
+#ifdef TIMER
+    /*
+     * Allow the remote end 4ms since it last transmitted to switch
+     * to Rx mode, usually that has passed while we were busy.
+     */
+    timer_wait(nrf24_rx_time, TIMER_TICKS(4));
+#else
+    /* Wait 4ms to allow the remote end to switch to Rx mode */
+    my_delay(4);
+#endif
+
+    nrf24_tx_start();
+    tx_tries = 128;
+    in_tx = 1;
+  }
+
+  /*
+   * Up to three packets can be queued in the chip, they go out while
+   * we're busy preparing the next one.  Only at the end of the reply
+   * do we need to wait for everything to be sent.
+   */
+  radio_tx_wait(0);
+  nrf24_tx_push(buf, len);
+  stat_add(STAT_TX, 1);
+
+  if (last) {
+    radio_tx_wait(1);
+    nrf24_tx_end();
+    in_tx = 0;
+  }
+#endif
+}
+
 void putch(char ch) {
   static uint8_t pkt_len = 0;
   static uint8_t pkt_buf[32];
 
-  pkt_buf[pkt_len++] = ch;
-
-  if (ch == STK_OK || pkt_len == pkt_max_len) {
-    uint8_t cnt = 128;
+  uint8_t last = ch == STK_OK;
 
-    while (--cnt) {
-      /* Wait 4ms to allow the remote end to switch to Rx mode */
-      my_delay(4);
+#ifdef RESYNC
+  /* Replies start with STK_INSYNC, one starting with STK_NOSYNC is just that */
+  if (ch == STK_NOSYNC && pkt_len == 1)
+    last = 1;
+#endif
+#ifdef BULK_READ
+  if (tx_raw)
+    last = 0;
+#endif
 
-      nrf24_tx(pkt_buf, pkt_len);
-      if (!nrf24_tx_result_wait())
-        break;
+  pkt_buf[pkt_len++] = ch;
 
-      /*
-      * TODO: also check if there's anything in the Rx FIFO - that
-      * would indicate that the other side has actually received our
-      * packet but the ACK may have been lost instead.  In any case
-      * the other side is not listening for what we're re-sending,
-      * maybe has given up and is resending the full command which
-      * is ok.
-      */
-    }
+  if (last || pkt_len == pkt_max_len) {
+    radio_send(pkt_buf, pkt_len, last);
 
     pkt_len = 1;
+#ifdef RADIO_ARQ
+    /* Bit 7 of the sequence number marks control packets */
+    pkt_buf[0] = (pkt_buf[0] + 1) & ARQ_SEQ_MASK;
+#else
     pkt_buf[0] ++;
+#endif
   }
 
 }
 
-uint8_t getch(void) {
-  uint8_t ch;
-  static uint8_t pkt_len = 0, pkt_start = 0;
-  static uint8_t pkt_buf[32];
+/* The packet getch() is working on, rx_len bytes left from rx_start on */
+static uint8_t rx_len = 0, rx_start = 0;
+static uint8_t rx_buf[32];
+
+#ifdef RADIO_ARQ
+static uint8_t arq_next;	/* Next sequence number to be delivered, 0 first */
+static uint8_t arq_have;	/* Window slots holding a packet */
+
+/*
+ * Sliding window receive, for packets that are not the next one in
+ * sequence.  They're either poll or control packets, duplicates, or they
+ * arrived early and get stored in the window until the packets before
+ * them are in.
+ */
+static void arq_push(uint8_t *buf, uint8_t len) {
+  uint8_t seq = buf[0], *slot;
+
+  if (seq == ARQ_ACK_REQ) {
+    /*
+     * Everything before arq_next has been received, plus whatever has
+     * its slot's bit set in arq_have, the slot number being the sequence
+     * number modulo the window size.
+     */
+    uint8_t report[3] = { ARQ_REPORT, arq_next, arq_have };
+
+    radio_send(report, 3, 1);
+    return;
+  }
+
+  if (len < 2 || (seq & ~ARQ_SEQ_MASK))
+    return;
+
+  seq = (seq - arq_next) & ARQ_SEQ_MASK;
+  if (seq < RADIO_ARQ_WINDOW) {
+    seq = buf[0] % RADIO_ARQ_WINDOW;
+    arq_have |= 1 << seq;
+
+    slot = arq_buf + seq * 33;
+    *slot++ = len;
+    do *slot++ = *buf++;
+    while (--len);
+  }
+#ifdef RADIO_STATS
+  /*
+   * Only a packet from just behind the window was delivered already, one
+   * beyond its far end is early and dropped, the gateway resends it.
+   */
+  else if (seq >= ARQ_SEQ_MASK + 1 - RADIO_ARQ_WINDOW)
+    stat_add(STAT_DUP, 1);
+#endif
+}
+
+/* Take the next packet in sequence out of the window if it's there */
+static uint8_t arq_pop(uint8_t *buf) {
+  uint8_t seq = arq_next % RADIO_ARQ_WINDOW, *slot, len;
+
+  if (!(arq_have & (1 << seq)))
+    return 0;
+
+  arq_have &= ~(1 << seq);
+  arq_next = (arq_next + 1) & ARQ_SEQ_MASK;
+
+  slot = arq_buf + seq * 33;
+  len = *slot++;
+  seq = len;
+  do *buf++ = *slot++;
+  while (--seq);
 
+  return len - 1;
+}
+#endif
+
+/*
+ * Wait for the next packet.  Returns its length with the chip still
+ * selected so the payload, sequence number first, can be clocked in.  If
+ * the next packet in sequence came out of the ARQ window instead, it's
+ * left in rx_buf with rx_len set.
+ */
+static uint8_t rx_wait(void) {
   while(1) {
-    if (pkt_len || nrf24_rx_fifo_data()) {
+#ifdef FLASH_PIPELINE
+    flash_poll();
+#endif
+#ifdef EEPROM_FAST
+    eeprom_poll();
+#endif
 
-      if (!pkt_len) {
-        static uint8_t seqn = 0xff;
-        watchdogReset();
-        nrf24_rx_read(pkt_buf, &pkt_len);
-        pkt_start = 1;
+#ifdef RADIO_ARQ
+    /* The next packet in sequence may already be waiting in the window */
+    if ((rx_len = arq_pop(rx_buf))) {
+      rx_start = 1;
+      return 0;
+    }
+#endif
 
-        if (!pkt_len)
-          continue;
+    if (nrf24_rx_fifo_data()) {
+      uint8_t len;
 
-        if (pkt_buf[0] == seqn) {
-          pkt_len = 0;
-          continue;
-        }
+      watchdogReset();
+      len = nrf24_rx_begin();
+      stat_add(STAT_RX, 1);
+      return len;
+    }
+  }
+}
 
-        seqn = pkt_buf[0];
-        pkt_len--;
-      }
+/*
+ * Check whether a packet with sequence number seq and total length len is
+ * the next one in sequence.  A packet with nothing but the sequence number
+ * is only a poll (or a wake-up packet), the gateway sends these to collect
+ * the ACK payloads.
+ */
+static uint8_t rx_next(uint8_t seq, uint8_t len) {
+#ifndef RADIO_ARQ
+  static uint8_t seqn = 0xff;
+#endif
+
+#ifdef RADIO_ARQ
+  if (len < 2 || (seq & ~ARQ_SEQ_MASK))
+    return 0;
+
+  if (seq != arq_next)
+    return 0;
+
+  arq_next = (arq_next + 1) & ARQ_SEQ_MASK;
+#else
+  if (len < 2)
+    return 0;
+
+  if (seq == seqn) {
+    stat_add(STAT_DUP, 1);
+    return 0;
+  }
+
+  seqn = seq;
+#endif
+  radio_mode = 1;
+
+  return 1;
+}
+
+/* Clock the rest of a payload that's not the next in sequence into rx_buf */
+static void rx_other(uint8_t seq, uint8_t len) {
+  uint8_t i;
+
+  rx_buf[0] = seq;
+  for (i = 1; i < len; i++)
+    rx_buf[i] = spi_transfer(0);
+  nrf24_csn(1);
+
+#ifdef RADIO_ARQ
+  arq_push(rx_buf, len);
+#endif
+}
+
+uint8_t getch(void) {
+  uint8_t ch, len;
 
-      ch = pkt_buf[pkt_start ++];
-      pkt_len --;
+  while (!rx_len) {
+    len = rx_wait();
+    if (rx_len)
       break;
+
+    ch = spi_transfer(0);
+    if (!rx_next(ch, len)) {
+      rx_other(ch, len);
+      continue;
     }
+
+    rx_len = len - 1;
+    for (rx_start = 1; rx_start < len; rx_start++)
+      rx_buf[rx_start] = spi_transfer(0);
+    nrf24_csn(1);
+    rx_start = 1;
   }
 
+  ch = rx_buf[rx_start ++];
+  rx_len --;
+
   return ch;
 }
 
+#ifdef RADIO_PAGE_STREAM
+/*
+ * Receive length bytes of flash page data (0 meaning 256) straight into
+ * the SPM page buffer at address.  Whatever getch() has left of its packet
+ * goes first, after that payloads are clocked in from the radio one byte
+ * at a time and every word is handed to the page buffer as soon as it's
+ * complete, rather than copying each payload into rx_buf and then the
+ * whole page into buff.  Any bytes in the last packet past the end of the
+ * page are left in rx_buf for getch().
+ */
+static void getpage(uint16_t address, uint8_t length) {
+  uint8_t ch, len = 0, i = 0;
+  uint16_t word = 0;
+
+  do {
+    /* len counts the bytes left in the payload being clocked in */
+    while (!rx_len && !len) {
+      len = rx_wait();
+      if (rx_len)
+        break;
+
+      ch = spi_transfer(0);
+      if (rx_next(ch, len))
+        len--;
+      else {
+        rx_other(ch, len);
+        len = 0;
+      }
+    }
+
+    if (rx_len) {
+      ch = rx_buf[rx_start ++];
+      rx_len --;
+    } else {
+      ch = spi_transfer(0);
+      if (!--len)
+        nrf24_csn(1);
+    }
+
+    flash_cmp(address, i, ch);
+    if (i & 1) {
+      /* The RWW page erase started by the caller may still be running */
+      flash_ready();
+      __boot_page_fill_short(address + i - 1, word | (ch << 8));
+    } else
+      word = ch;
+    i++;
+  } while (--length);
+
+  if (i & 1) {
+    flash_ready();
+    __boot_page_fill_short(address + i - 1, word | 0xff00);
+  }
+
+  if (len) {
+    rx_len = len;
+    rx_start = 0;
+    do rx_buf[rx_start++] = spi_transfer(0);
+    while (--len);
+    nrf24_csn(1);
+    rx_start = 0;
+  }
+}
+#endif
+
+#ifdef RADIO_ACK_PAYLOAD
+/*
+ * Discard a poll waiting in the Rx FIFO.  Returns 1 if a data packet is
+ * at the head instead, that one is left in place for getch().
+ */
+uint8_t drop_polls(void) {
+  uint8_t buf[1], len;
+
+  if (nrf24_rx_fifo_data()) {
+    if (nrf24_rx_data_avail() >= 2)
+      return 1;
+    watchdogReset();
+    nrf24_rx_read(buf, &len);
+    stat_add(STAT_RX, 1);
+  }
+  return 0;
+}
+#endif
+
+#ifndef RADIO_ACK_PAYLOAD
+/*
+ * Wait until there's room for another packet in the Tx FIFO, or until
+ * it's empty if drain is set.  Payloads that hit MAX_RT are retried,
+ * after 127 failures in a row everything queued is dropped.
+ */
+void radio_tx_wait(uint8_t drain) {
+  uint8_t status;
+
+  while (drain ? !nrf24_tx_empty() : nrf24_tx_full()) {
+    status = nrf24_tx_event();
+#if defined(RADIO_ADAPTIVE_ARD) || defined(RADIO_STATS)
+    if (status & ((1 << TX_DS) | (1 << MAX_RT))) {
+      uint8_t arc = nrf24_arc_cnt();
+
+#ifdef RADIO_ADAPTIVE_ARD
+      nrf24_ard_update(status, arc);
+#endif
+      stat_add(STAT_ARC, arc);
+    }
+#endif
+
+    if (status & (1 << TX_DS)) {
+      tx_tries = 128;
+      continue;
+    }
+
+    /* A timeout without either event isn't a MAX_RT */
+    if (status & (1 << MAX_RT))
+      stat_add(STAT_MAX_RT, 1);
+
+    if (!--tx_tries) {
+      /*
+      * TODO: also check if there's anything in the Rx FIFO - that
+      * would indicate that the other side has actually received our
+      * packet but the ACK may have been lost instead.  In any case
+      * the other side is not listening for what we're re-sending,
+      * maybe has given up and is resending the full command which
+      * is ok.
+      */
+      nrf24_tx_flush();
+      break;
+    }
+
+    stat_add(STAT_TX, 1);
+    nrf24_tx_retry();
+  }
+}
+#endif
+
 void getNch(uint8_t count) {
   do getch(); while (--count);
-  verifySpace();
 }
 
 void wait_timeout(void) {
@@ -854,18 +2663,93 @@ void wait_timeout(void) {
     ;				      //  a reset and app start.
 }
 
-void verifySpace(void) {
-  if (getch() != CRC_EOP)
+#ifdef RESYNC
+/*
+ * Get back in step after a command without its CRC_EOP, instead of
+ * resetting: drop whatever else arrives until the gateway has been quiet
+ * for RESYNC_QUIET_MS, leave the flash ready for the next command and
+ * tell the host with a lone STK_NOSYNC.  avrdude then sends STK_GET_SYNC
+ * and repeats the command.  Packets still go through rx_next() and
+ * rx_other() so that the sequence numbers stay accounted for.  Polls
+ * don't count as traffic, the gateway keeps sending those until it gets
+ * the reply, but they don't count as quiet time either.  Without TIMER
+ * that is only the 1ms waits with nothing received, so the wait can come
+ * out longer but not shorter.
+ */
+#ifdef TIMER
+#define quiet_reset() (since = timer_read())
+#define quiet_over() (timer_read() - since >= TIMER_TICKS(RESYNC_QUIET_MS))
+#else
+#define quiet_reset() (quiet = RESYNC_QUIET_MS)
+#define quiet_over() (my_delay(1), !--quiet)
+#endif
+
+static void resync(void) {
+  uint8_t seq, len;
+#ifdef TIMER
+  uint32_t since;
+#else
+  uint8_t quiet;
+#endif
+
+  rx_len = 0;
+  quiet_reset();
+  for (;;) {
+    watchdogReset();
+#ifdef RADIO_ARQ
+    /* The rest of the command may be waiting in the window already */
+    while (arq_pop(rx_buf))
+      quiet_reset();
+#endif
+
+    if (!nrf24_rx_fifo_data()) {
+      if (quiet_over())
+        break;
+      continue;
+    }
+
+    len = nrf24_rx_begin();
+    stat_add(STAT_RX, 1);
+    seq = spi_transfer(0);
+    if (len >= 2)
+      quiet_reset();
+    if (rx_next(seq, len)) {
+      while (--len)
+        spi_transfer(0);
+      nrf24_csn(1);
+    } else
+      rx_other(seq, len);
+  }
+
+  flash_idle();
+  putch(STK_NOSYNC);
+}
+#endif
+
+uint8_t verifySpace(void) {
+  if (getch() != CRC_EOP) {
+#ifdef RESYNC
+    resync();
+    return 1;
+#else
     wait_timeout();
+#endif
+  }
   putch(STK_INSYNC);
+  return 0;
 }
 
 #if LED_START_FLASHES > 0
 void flash_led(uint8_t count) {
   do {
+#ifdef TIMER
+    /* Timer 1 is the free-running radio timebase, don't reload it */
+    my_delay(1000.0 / 16);
+#else
     TCNT1 = -(F_CPU/(1024*16));
     TIFR1 = _BV(TOV1);
     while(!(TIFR1 & _BV(TOV1)));
+#endif
 #if defined(__AVR_ATmega8__)  || defined (__AVR_ATmega32__)
     LED_PORT ^= _BV(LED);
 #else
@@ -891,6 +2775,10 @@ void watchdogConfig(uint8_t x) {
 
 void appStart(uint8_t rstFlags) {
   watchdogConfig(WATCHDOG_OFF);
+#ifdef TIMER
+  // Leave Timer 1 stopped like after reset
+  TCCR1B = 0;
+#endif
 
   // save the reset flags in the designated register
   //  This can be saved in a main program by putting code in .init0 (which
@@ -17,6 +17,13 @@
 #define UART_TX_BIT 1
 #define UART_RX_BIT 0
 #endif
+
+/* nRF24L01+ IRQ line (INT0, Arduino digital pin 2) */
+#if defined(RADIO_IRQ) && !defined(IRQ_PIN)
+#define IRQ_INPUT   PIND
+#define IRQ_DDR     DDRD
+#define IRQ_PIN     (1 << 2)
+#endif
 #endif
 
 #if defined(__AVR_ATmega8__) || defined(__AVR_ATmega32__)
@@ -69,6 +76,13 @@
 #define UART_TX_BIT 1
 #define UART_RX_BIT 0
 #endif
+
+/* nRF24L01+ IRQ line (INT0) */
+#if defined(RADIO_IRQ) && !defined(IRQ_PIN)
+#define IRQ_INPUT   PIND
+#define IRQ_DDR     DDRD
+#define IRQ_PIN     (1 << 2)
+#endif
 #endif
 
 /*------------------------------------------------------------------------ */
@@ -88,6 +102,13 @@
 #define UART_TX_BIT 1
 #define UART_RX_BIT 0
 #endif
+
+/* nRF24L01+ IRQ line (INT4, Arduino digital pin 2) */
+#if defined(RADIO_IRQ) && !defined(IRQ_PIN)
+#define IRQ_INPUT   PINE
+#define IRQ_DDR     DDRE
+#define IRQ_PIN     (1 << 4)
+#endif
 #endif
 
 /*
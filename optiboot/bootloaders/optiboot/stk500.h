@@ -37,3 +37,14 @@
 #define STK_READ_OSCCAL     0x76  // 'v'
 #define STK_READ_FUSE_EXT   0x77  // 'w'
 #define STK_READ_OSCCAL_EXT 0x78  // 'x'
+
+/* Radio extensions, not part of STK500v1 */
+#define STK_PROG_MULTI      0xe0  // Flash pages back to back, see optiboot.c
+#define STK_PROG_LZ         0xe1  // Compressed flash pages, see optiboot.c
+#define STK_PAGE_CRC        0xe2  // CRC-16 of each flash page in a range
+#define STK_FLASH_HASH      0xe3  // CRC-32 of a flash range
+#define STK_RESUME          0xe4  // Pages written by an interrupted upload
+#define STK_MANIFEST        0xe5  // Length, CRC-32 and build id of the image
+#define Parm_RADIO_CHANNEL  0xc0  // Quietest channel / switch channels
+#define Parm_RADIO_RATE     0xc1  // Air data rate: 0 2Mbps, 1 1Mbps, 2 250kbps
+#define Parm_RADIO_STATS    0xd0  // Session counters, 0xd0-0xdd